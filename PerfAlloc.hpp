@@ -0,0 +1,335 @@
+#pragma once
+
+#include <dlfcn.h>
+#include <malloc.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <ostream>
+
+#include "PerfEvent.hpp"
+
+/**
+ * Counts heap allocations per region: allocations, frees and bytes allocated per scale unit, and
+ * the peak of additionally outstanding bytes. The hooks are compiled into exactly one translation
+ * unit of the program, which replaces malloc & co. and operator new/delete:
+ *
+ *   #define PERF_ALLOC_INTERPOSE
+ *   #include "PerfAlloc.hpp"
+ *
+ *   e.extensions.push_back(std::make_shared<PerfAlloc>());
+ *   { PerfEventBlock block(e, n); run(); }
+ *
+ * The hooks forward to the next definition (glibc malloc, or jemalloc/tcmalloc linked as shared
+ * libraries) and update counters of the calling thread without locks or atomic read-modify-writes.
+ * They are weak, so a statically linked allocator keeps its malloc and only operator new is counted.
+ * Byte counts use malloc_usable_size, the requested size is not known on free.
+ * */
+struct PerfAlloc : PerfEvent::Extension {
+    // counters of one thread, written only by it; slots stay in the list after the thread exits
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> allocs{0};
+        std::atomic<uint64_t> frees{0};
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<int64_t> outstanding{0};  // allocated minus freed by this thread, may be negative
+        std::atomic<int64_t> base{0};         // outstanding when this thread first allocated in the epoch
+        std::atomic<int64_t> peak{0};
+        std::atomic<uint64_t> epoch{0};
+        Slot* next = nullptr;
+    };
+
+    struct Stats {
+        uint64_t allocs = 0;
+        uint64_t frees = 0;
+        uint64_t bytes = 0;
+        int64_t outstanding = 0;
+        // sum of the per-thread peaks since the region started: exact for a single thread, an upper
+        // bound when threads peak at different times
+        int64_t peak = 0;
+    };
+
+    Stats begin, end;
+
+    void start(PerfEvent&) override {
+        // new epoch, every thread restarts its peak at its next allocation
+        epoch().fetch_add(1, std::memory_order_relaxed);
+        begin = snapshot();
+    }
+
+    void stop(PerfEvent&) override { end = snapshot(); }
+
+    Stats delta() const {
+        Stats d;
+        d.allocs = end.allocs - begin.allocs;
+        d.frees = end.frees - begin.frees;
+        d.bytes = end.bytes - begin.bytes;
+        d.outstanding = end.outstanding - begin.outstanding;
+        d.peak = end.peak;
+        return d;
+    }
+
+    void report(PerfEvent&, std::ostream& headerOut, std::ostream& dataOut, uint64_t normalizationConstant) override {
+        if (!interposed()) { return; }
+        Stats d = delta();
+        double n = static_cast<double>(normalizationConstant);
+        PerfEvent::printCounter(headerOut, dataOut, "allocs", d.allocs / n);
+        PerfEvent::printCounter(headerOut, dataOut, "frees", d.frees / n);
+        PerfEvent::printCounter(headerOut, dataOut, "alloc bytes", d.bytes / n);
+        PerfEvent::printCounter(headerOut, dataOut, "peak bytes", d.peak);
+    }
+
+    // totals over all threads that ever allocated; peak only covers the current epoch
+    static Stats snapshot() {
+        Stats s;
+        uint64_t current = epoch().load(std::memory_order_relaxed);
+        for (Slot* slot = head().load(std::memory_order_acquire); slot; slot = slot->next) {
+            s.allocs += slot->allocs.load(std::memory_order_relaxed);
+            s.frees += slot->frees.load(std::memory_order_relaxed);
+            s.bytes += slot->bytes.load(std::memory_order_relaxed);
+            s.outstanding += slot->outstanding.load(std::memory_order_relaxed);
+            if (slot->epoch.load(std::memory_order_relaxed) == current) {
+                s.peak += slot->peak.load(std::memory_order_relaxed) - slot->base.load(std::memory_order_relaxed);
+            }
+        }
+        return s;
+    }
+
+    // whether the hooks are linked in and have seen an allocation
+    static bool interposed() { return head().load(std::memory_order_relaxed) != nullptr; }
+
+    static std::atomic<Slot*>& head() {
+        static std::atomic<Slot*> list{nullptr};
+        return list;
+    }
+
+    static std::atomic<uint64_t>& epoch() {
+        static std::atomic<uint64_t> value{1};
+        return value;
+    }
+
+    // called by the hooks, `slot` is the calling thread's
+    static void count(Slot& slot, int64_t usable, uint64_t requested, bool allocation) {
+        auto bump = [](auto& counter, auto amount) {
+            counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+        };
+        uint64_t current = epoch().load(std::memory_order_relaxed);
+        if (slot.epoch.load(std::memory_order_relaxed) != current) {
+            int64_t outstanding = slot.outstanding.load(std::memory_order_relaxed);
+            slot.base.store(outstanding, std::memory_order_relaxed);
+            slot.peak.store(outstanding, std::memory_order_relaxed);
+            slot.epoch.store(current, std::memory_order_relaxed);
+        }
+        if (!allocation) {
+            bump(slot.frees, 1);
+            bump(slot.outstanding, -usable);
+            return;
+        }
+        bump(slot.allocs, 1);
+        bump(slot.bytes, requested);
+        bump(slot.outstanding, usable);
+        int64_t outstanding = slot.outstanding.load(std::memory_order_relaxed);
+        if (outstanding > slot.peak.load(std::memory_order_relaxed)) { slot.peak.store(outstanding, std::memory_order_relaxed); }
+    }
+};
+
+#ifdef PERF_ALLOC_INTERPOSE
+namespace perf_alloc {
+
+using MallocFn = void* (*)(size_t);
+using FreeFn = void (*)(void*);
+using CallocFn = void* (*)(size_t, size_t);
+using ReallocFn = void* (*)(void*, size_t);
+using MemalignFn = void* (*)(size_t, size_t);
+using PosixMemalignFn = int (*)(void**, size_t, size_t);
+
+struct Next {
+    MallocFn malloc;
+    FreeFn free;
+    CallocFn calloc;
+    ReallocFn realloc;
+    MemalignFn memalign;
+    MemalignFn aligned_alloc;
+    PosixMemalignFn posix_memalign;
+};
+
+// dlsym may allocate itself; those requests are served from here and never freed. Only the thread
+// that resolves sets `resolving`, others wait for next() in its static initialization, so
+// bootstrap_used is only ever advanced by one thread.
+alignas(64) static char bootstrap[8192];
+static size_t bootstrap_used = 0;
+static __thread bool resolving __attribute__((tls_model("initial-exec"))) = false;
+
+inline bool from_bootstrap(void* p) { return p >= bootstrap && p < bootstrap + sizeof(bootstrap); }
+
+inline void* bootstrap_alloc(size_t size, size_t alignment = 16) {
+    if (!alignment || (alignment & (alignment - 1))) { return nullptr; }
+    alignment = std::max<size_t>(alignment, 16);
+    uintptr_t begin = reinterpret_cast<uintptr_t>(bootstrap);
+    size_t offset = ((begin + bootstrap_used + alignment - 1) & ~(alignment - 1)) - begin;
+    size = (size + 15) & ~size_t(15);
+    if (offset > sizeof(bootstrap) || size > sizeof(bootstrap) - offset) { return nullptr; }
+    bootstrap_used = offset + size;
+    return bootstrap + offset;
+}
+
+inline const Next& next() {
+    static Next fns = [] {
+        resolving = true;
+        Next n;
+        n.malloc = reinterpret_cast<MallocFn>(dlsym(RTLD_NEXT, "malloc"));
+        n.free = reinterpret_cast<FreeFn>(dlsym(RTLD_NEXT, "free"));
+        n.calloc = reinterpret_cast<CallocFn>(dlsym(RTLD_NEXT, "calloc"));
+        n.realloc = reinterpret_cast<ReallocFn>(dlsym(RTLD_NEXT, "realloc"));
+        n.memalign = reinterpret_cast<MemalignFn>(dlsym(RTLD_NEXT, "memalign"));
+        n.aligned_alloc = reinterpret_cast<MemalignFn>(dlsym(RTLD_NEXT, "aligned_alloc"));
+        n.posix_memalign = reinterpret_cast<PosixMemalignFn>(dlsym(RTLD_NEXT, "posix_memalign"));
+        resolving = false;
+        return n;
+    }();
+    return fns;
+}
+
+// initial-exec TLS without a constructor, so accessing it never allocates
+static __thread PerfAlloc::Slot* thread_slot __attribute__((tls_model("initial-exec"))) = nullptr;
+
+inline PerfAlloc::Slot* slot() {
+    if (thread_slot) { return thread_slot; }
+    void* memory = nullptr;
+    if (next().posix_memalign(&memory, alignof(PerfAlloc::Slot), sizeof(PerfAlloc::Slot))) { return nullptr; }
+    auto* s = new (memory) PerfAlloc::Slot();
+    auto& head = PerfAlloc::head();
+    s->next = head.load(std::memory_order_relaxed);
+    while (!head.compare_exchange_weak(s->next, s, std::memory_order_release, std::memory_order_relaxed)) {}
+    thread_slot = s;
+    return s;
+}
+
+inline void allocated(void* p, size_t requested) {
+    if (!p) { return; }
+    if (auto* s = slot()) { PerfAlloc::count(*s, static_cast<int64_t>(malloc_usable_size(p)), requested, true); }
+}
+
+inline void freed(size_t usable) {
+    if (auto* s = slot()) { PerfAlloc::count(*s, static_cast<int64_t>(usable), 0, false); }
+}
+
+}  // namespace perf_alloc
+
+extern "C" {
+
+__attribute__((weak)) void* malloc(size_t size) noexcept {
+    if (perf_alloc::resolving) { return perf_alloc::bootstrap_alloc(size); }
+    void* p = perf_alloc::next().malloc(size);
+    perf_alloc::allocated(p, size);
+    return p;
+}
+
+__attribute__((weak)) void free(void* p) noexcept {
+    if (!p || perf_alloc::from_bootstrap(p)) { return; }
+    perf_alloc::freed(malloc_usable_size(p));
+    perf_alloc::next().free(p);
+}
+
+__attribute__((weak)) void* calloc(size_t count, size_t size) noexcept {
+    if (perf_alloc::resolving) {
+        // bootstrap memory is static and thus already zeroed
+        if (size && count > SIZE_MAX / size) { return nullptr; }
+        return perf_alloc::bootstrap_alloc(count * size);
+    }
+    void* p = perf_alloc::next().calloc(count, size);
+    perf_alloc::allocated(p, count * size);
+    return p;
+}
+
+__attribute__((weak)) void* realloc(void* old, size_t size) noexcept {
+    if (perf_alloc::from_bootstrap(old)) {
+        void* p = malloc(size);
+        if (p) { memcpy(p, old, std::min<size_t>(size, perf_alloc::bootstrap + sizeof(perf_alloc::bootstrap) - static_cast<char*>(old))); }
+        return p;
+    }
+    // the old block is only released if realloc succeeds (or frees it for size 0), and then its
+    // size can no longer be queried
+    size_t usable = old ? malloc_usable_size(old) : 0;
+    void* p = perf_alloc::next().realloc(old, size);
+    if (old && (p || !size)) { perf_alloc::freed(usable); }
+    perf_alloc::allocated(p, size);
+    return p;
+}
+
+__attribute__((weak)) int posix_memalign(void** out, size_t alignment, size_t size) noexcept {
+    if (perf_alloc::resolving) {
+        *out = perf_alloc::bootstrap_alloc(size, alignment);
+        return *out ? 0 : ENOMEM;
+    }
+    int result = perf_alloc::next().posix_memalign(out, alignment, size);
+    if (!result) { perf_alloc::allocated(*out, size); }
+    return result;
+}
+
+__attribute__((weak)) void* aligned_alloc(size_t alignment, size_t size) noexcept {
+    if (perf_alloc::resolving) { return perf_alloc::bootstrap_alloc(size, alignment); }
+    void* p = perf_alloc::next().aligned_alloc(alignment, size);
+    perf_alloc::allocated(p, size);
+    return p;
+}
+
+__attribute__((weak)) void* memalign(size_t alignment, size_t size) noexcept {
+    if (perf_alloc::resolving) { return perf_alloc::bootstrap_alloc(size, alignment); }
+    void* p = perf_alloc::next().memalign(alignment, size);
+    perf_alloc::allocated(p, size);
+    return p;
+}
+
+}  // extern "C"
+
+// An allocator with its own operator new (e.g. jemalloc built with C++ support) would bypass malloc.
+namespace perf_alloc {
+
+inline void* new_or_throw(size_t size, size_t alignment) {
+    for (;;) {
+        void* p = alignment > alignof(std::max_align_t) ? aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment)
+                                                         : malloc(size ? size : 1);
+        if (p) { return p; }
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) { throw std::bad_alloc(); }
+        handler();
+    }
+}
+
+inline void* new_nothrow(size_t size, size_t alignment) noexcept {
+    try {
+        return new_or_throw(size, alignment);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+}  // namespace perf_alloc
+
+__attribute__((weak)) void* operator new(size_t size) { return perf_alloc::new_or_throw(size, 0); }
+__attribute__((weak)) void* operator new[](size_t size) { return perf_alloc::new_or_throw(size, 0); }
+__attribute__((weak)) void* operator new(size_t size, const std::nothrow_t&) noexcept { return perf_alloc::new_nothrow(size, 0); }
+__attribute__((weak)) void* operator new[](size_t size, const std::nothrow_t&) noexcept { return perf_alloc::new_nothrow(size, 0); }
+__attribute__((weak)) void operator delete(void* p) noexcept { free(p); }
+__attribute__((weak)) void operator delete[](void* p) noexcept { free(p); }
+__attribute__((weak)) void operator delete(void* p, size_t) noexcept { free(p); }
+__attribute__((weak)) void operator delete[](void* p, size_t) noexcept { free(p); }
+__attribute__((weak)) void operator delete(void* p, const std::nothrow_t&) noexcept { free(p); }
+__attribute__((weak)) void operator delete[](void* p, const std::nothrow_t&) noexcept { free(p); }
+#if __cplusplus >= 201703L
+__attribute__((weak)) void* operator new(size_t size, std::align_val_t a) { return perf_alloc::new_or_throw(size, static_cast<size_t>(a)); }
+__attribute__((weak)) void* operator new[](size_t size, std::align_val_t a) { return perf_alloc::new_or_throw(size, static_cast<size_t>(a)); }
+__attribute__((weak)) void* operator new(size_t size, std::align_val_t a, const std::nothrow_t&) noexcept { return perf_alloc::new_nothrow(size, static_cast<size_t>(a)); }
+__attribute__((weak)) void* operator new[](size_t size, std::align_val_t a, const std::nothrow_t&) noexcept { return perf_alloc::new_nothrow(size, static_cast<size_t>(a)); }
+__attribute__((weak)) void operator delete(void* p, std::align_val_t) noexcept { free(p); }
+__attribute__((weak)) void operator delete[](void* p, std::align_val_t) noexcept { free(p); }
+__attribute__((weak)) void operator delete(void* p, size_t, std::align_val_t) noexcept { free(p); }
+__attribute__((weak)) void operator delete[](void* p, size_t, std::align_val_t) noexcept { free(p); }
+#endif
+#endif
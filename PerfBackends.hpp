@@ -0,0 +1,497 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "PerfEvent.hpp"
+
+/**
+ * Alternative PerfBackend implementations, selected per instance or process-wide:
+ *
+ *   PerfEvent e(std::make_shared<PerfRdpmcBackend>(true));
+ *   PerfBackend::defaultBackend() = cheapestPerfBackend();  // for every PerfEvent created afterwards
+ * */
+
+/**
+ * Reads counters of the calling thread from user space with rdpmc instead of a read() syscall.
+ * The kernel exposes the counter index and time scaling in the first page of the mapped counter,
+ * so reads cost a few dozen cycles. rdpmc only sees the thread the counter was opened on, so
+ * counters that inherit to child threads (the default of PerfEvent) are read with the syscall,
+ * unless calling_thread_only opens the calling thread's counters without inherit; threads it
+ * starts are then not counted. Reads from other threads, of disabled counters, or on CPUs without
+ * user-space rdpmc fall back to the syscall.
+ * */
+struct PerfRdpmcBackend : PerfSyscallBackend {
+    static constexpr int max_fds = 4096;
+
+    struct Slot {
+        std::atomic<perf_event_mmap_page*> page{nullptr};
+        pid_t tid = 0;
+    };
+    std::unique_ptr<Slot[]> slots{new Slot[max_fds]};
+    size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    bool calling_thread_only;
+
+    explicit PerfRdpmcBackend(bool calling_thread_only = false) : calling_thread_only(calling_thread_only) {}
+
+    ~PerfRdpmcBackend() override {
+        for (int fd = 0; fd < max_fds; ++fd) {
+            if (auto* page = slots[fd].page.load()) { munmap(page, page_size); }
+        }
+    }
+
+    int openEvent(perf_event_attr& pe, pid_t pid, int cpu, int groupFd, unsigned long flags) override {
+        bool self = pid == 0 && cpu == -1 && !(flags & PERF_FLAG_PID_CGROUP);
+        if (self && calling_thread_only) { pe.inherit = 0; }
+        self = self && !pe.inherit;
+        int fd = PerfSyscallBackend::openEvent(pe, pid, cpu, groupFd, flags);
+        if (fd < 0 || fd >= max_fds || !self) { return fd; }
+        void* mem = mmap(nullptr, page_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (mem != MAP_FAILED) {
+            slots[fd].tid = current_tid();
+            slots[fd].page.store(static_cast<perf_event_mmap_page*>(mem), std::memory_order_release);
+        }
+        return fd;
+    }
+
+    bool readEvent(int handle, PerfReadFormat& out) override {
+        if (handle >= 0 && handle < max_fds) {
+            auto* page = slots[handle].page.load(std::memory_order_acquire);
+            if (page && slots[handle].tid == current_tid() && read_page(page, out)) { return true; }
+        }
+        return PerfSyscallBackend::readEvent(handle, out);
+    }
+
+    void closeEvent(int handle) override {
+        if (handle >= 0 && handle < max_fds) {
+            if (auto* page = slots[handle].page.exchange(nullptr)) { munmap(page, page_size); }
+        }
+        PerfSyscallBackend::closeEvent(handle);
+    }
+
+    // true if this CPU lets user space read counters, probed once with an instructions counter
+    static bool available() {
+        static bool result = [] {
+            perf_event_attr pe = {};
+            pe.type = PERF_TYPE_HARDWARE;
+            pe.size = sizeof(pe);
+            pe.config = PERF_COUNT_HW_INSTRUCTIONS;
+            pe.exclude_kernel = 1;
+            int fd = static_cast<int>(syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0));
+            if (fd < 0) { return false; }
+            size_t size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            void* mem = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            bool usable = false;
+            if (mem != MAP_FAILED) {
+                auto* page = static_cast<perf_event_mmap_page*>(mem);
+                usable = page->cap_user_rdpmc && page->cap_user_time && has_rdpmc;
+                munmap(mem, size);
+            }
+            close(fd);
+            return usable;
+        }();
+        return result;
+    }
+
+private:
+#if defined(__x86_64__) || defined(__i386__)
+    static constexpr bool has_rdpmc = true;
+    static uint64_t rdpmc(uint32_t counter) {
+        uint32_t low, high;
+        asm volatile("rdpmc" : "=a"(low), "=d"(high) : "c"(counter));
+        return static_cast<uint64_t>(high) << 32 | low;
+    }
+    static uint64_t rdtsc() {
+        uint32_t low, high;
+        asm volatile("rdtsc" : "=a"(low), "=d"(high));
+        return static_cast<uint64_t>(high) << 32 | low;
+    }
+#else
+    static constexpr bool has_rdpmc = false;
+    static uint64_t rdpmc(uint32_t) { return 0; }
+    static uint64_t rdtsc() { return 0; }
+#endif
+
+    static pid_t current_tid() {
+        static thread_local pid_t tid = static_cast<pid_t>(syscall(SYS_gettid));
+        return tid;
+    }
+
+    // the seqlock protocol documented in linux/perf_event.h, false if the counter is not on this CPU
+    static bool read_page(const perf_event_mmap_page* page, PerfReadFormat& out) {
+        if (!has_rdpmc) { return false; }
+        const volatile perf_event_mmap_page* pc = page;
+        uint32_t seq;
+        do {
+            seq = pc->lock;
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+            uint32_t index = pc->index;
+            if (!pc->cap_user_rdpmc || !pc->cap_user_time || !index) { return false; }
+            uint64_t enabled = pc->time_enabled;
+            uint64_t running = pc->time_running;
+            uint64_t cycles = rdtsc();
+            uint16_t shift = pc->time_shift;
+            uint64_t quot = cycles >> shift;
+            uint64_t rem = cycles & ((uint64_t(1) << shift) - 1);
+            uint64_t delta = pc->time_offset + quot * pc->time_mult + ((rem * pc->time_mult) >> shift);
+            int64_t count = static_cast<int64_t>(rdpmc(index - 1));
+            unsigned width = pc->pmc_width;
+            count <<= 64 - width;
+            count >>= 64 - width;
+            out.value = static_cast<uint64_t>(pc->offset + count);
+            out.time_enabled = enabled + delta;
+            out.time_running = running + delta;
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+        } while (pc->lock != seq);
+        return true;
+    }
+};
+
+/**
+ * Counters derived from clocks and getrusage for machines without a usable PMU (containers, CI, VMs
+ * with perf_event_paranoid > 2). Only provides task-clock, cpu-clock, page faults and context
+ * switches of the calling process; all other counters are dropped by PerfEvent.
+ * */
+struct PerfSoftwareBackend : PerfBackend {
+    struct Counter {
+        uint64_t config;
+        bool open = true;
+        bool enabled = false;
+        uint64_t count = 0;      // accumulated while enabled, up to the last disable
+        uint64_t base = 0;       // sample() at the last enable or reset
+        uint64_t time = 0;       // ns spent enabled, up to the last disable
+        uint64_t since = 0;      // now() at the last enable
+    };
+    std::mutex mutex;
+    std::vector<Counter> counters;
+
+    bool supports(const perf_event_attr& pe) override {
+        if (pe.type != PERF_TYPE_SOFTWARE) { return false; }
+        switch (pe.config) {
+            case PERF_COUNT_SW_TASK_CLOCK:
+            case PERF_COUNT_SW_CPU_CLOCK:
+            case PERF_COUNT_SW_PAGE_FAULTS:
+            case PERF_COUNT_SW_PAGE_FAULTS_MIN:
+            case PERF_COUNT_SW_PAGE_FAULTS_MAJ:
+            case PERF_COUNT_SW_CONTEXT_SWITCHES: return true;
+            default: return false;
+        }
+    }
+
+    int openEvent(perf_event_attr& pe, pid_t pid, int cpu, int, unsigned long flags) override {
+        if (!supports(pe) || pid != 0 || cpu != -1 || flags) {
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+        std::lock_guard<std::mutex> guard(mutex);
+        counters.push_back(Counter{pe.config});
+        if (!pe.disabled) { enable(counters.back()); }
+        return static_cast<int>(counters.size() - 1);
+    }
+
+    bool readEvent(int handle, PerfReadFormat& out) override {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (handle < 0 || static_cast<size_t>(handle) >= counters.size() || !counters[handle].open) { return false; }
+        auto& c = counters[handle];
+        out.value = c.count + (c.enabled ? sample(c.config) - c.base : 0);
+        out.time_enabled = out.time_running = c.time + (c.enabled ? now() - c.since : 0);
+        return true;
+    }
+
+    void controlEvent(int handle, unsigned long request) override {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (handle < 0 || static_cast<size_t>(handle) >= counters.size()) { return; }
+        auto& c = counters[handle];
+        if (request == PERF_EVENT_IOC_ENABLE && !c.enabled) {
+            enable(c);
+        } else if (request == PERF_EVENT_IOC_DISABLE && c.enabled) {
+            c.count += sample(c.config) - c.base;
+            c.time += now() - c.since;
+            c.enabled = false;
+        } else if (request == PERF_EVENT_IOC_RESET) {
+            // like the kernel, a reset clears the count but not the enabled/running times
+            c.count = 0;
+            if (c.enabled) { c.base = sample(c.config); }
+        }
+    }
+
+    void closeEvent(int handle) override {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (handle >= 0 && static_cast<size_t>(handle) < counters.size()) { counters[handle].open = false; }
+    }
+
+private:
+    static uint64_t now() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec);
+    }
+
+    static uint64_t sample(uint64_t config) {
+        if (config == PERF_COUNT_SW_TASK_CLOCK || config == PERF_COUNT_SW_CPU_CLOCK) {
+            timespec ts;
+            clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+            return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec);
+        }
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        switch (config) {
+            case PERF_COUNT_SW_PAGE_FAULTS: return static_cast<uint64_t>(usage.ru_minflt + usage.ru_majflt);
+            case PERF_COUNT_SW_PAGE_FAULTS_MIN: return static_cast<uint64_t>(usage.ru_minflt);
+            case PERF_COUNT_SW_PAGE_FAULTS_MAJ: return static_cast<uint64_t>(usage.ru_majflt);
+            default: return static_cast<uint64_t>(usage.ru_nvcsw + usage.ru_nivcsw);
+        }
+    }
+
+    void enable(Counter& c) {
+        c.base = sample(c.config);
+        c.since = now();
+        c.enabled = true;
+    }
+};
+
+/**
+ * Entry of a recording written by PerfRecordingBackend. Counters are identified by the order in
+ * which they were opened, so replay does not depend on file descriptor numbers.
+ * */
+struct PerfRecordingEntry {
+    static constexpr uint32_t magic = 0x43455250;  // "PREC"
+    enum Kind : uint32_t { OPEN, OPEN_FAILED, READ, READ_FAILED };
+
+    uint32_t kind;
+    uint32_t counter;  // open sequence number
+    uint64_t a;        // OPEN: type, READ: value
+    uint64_t b;        // OPEN: config, READ: time_enabled
+    uint64_t c;        // OPEN_FAILED: errno, READ: time_running
+};
+
+/**
+ * Forwards to another backend and appends every open and read to a file, so that a run on a
+ * machine with a PMU can be reproduced later with PerfReplayBackend, e.g. to test report formatting
+ * or derived metrics in CI.
+ * */
+struct PerfRecordingBackend : PerfBackend {
+    std::shared_ptr<PerfBackend> inner;
+    FILE* file = nullptr;
+    std::mutex mutex;
+    uint32_t opened = 0;
+    std::map<int, uint32_t> counter_of;  // live handle -> open sequence number
+
+    PerfRecordingBackend(std::shared_ptr<PerfBackend> inner, const std::string& path) : inner(std::move(inner)) {
+        file = fopen(path.c_str(), "wbe");
+        if (!file) {
+            std::cerr << "Error creating recording " << path << std::endl;
+            return;
+        }
+        uint32_t magic = PerfRecordingEntry::magic;
+        fwrite(&magic, sizeof(magic), 1, file);
+    }
+
+    ~PerfRecordingBackend() override {
+        if (file) { fclose(file); }
+    }
+
+    PerfRecordingBackend(const PerfRecordingBackend&) = delete;
+
+    bool supports(const perf_event_attr& pe) override { return inner->supports(pe); }
+
+    int openEvent(perf_event_attr& pe, pid_t pid, int cpu, int groupFd, unsigned long flags) override {
+        int handle = inner->openEvent(pe, pid, cpu, groupFd, flags);
+        int error = errno;
+        std::lock_guard<std::mutex> guard(mutex);
+        uint32_t counter = opened++;
+        if (handle >= 0) { counter_of[handle] = counter; }
+        append({handle >= 0 ? PerfRecordingEntry::OPEN : PerfRecordingEntry::OPEN_FAILED, counter, pe.type, pe.config,
+                static_cast<uint64_t>(handle >= 0 ? 0 : error)});
+        errno = error;
+        return handle;
+    }
+
+    bool readEvent(int handle, PerfReadFormat& out) override {
+        bool ok = inner->readEvent(handle, out);
+        std::lock_guard<std::mutex> guard(mutex);
+        auto it = counter_of.find(handle);
+        if (it != counter_of.end()) {
+            if (ok) {
+                append({PerfRecordingEntry::READ, it->second, out.value, out.time_enabled, out.time_running});
+            } else {
+                append({PerfRecordingEntry::READ_FAILED, it->second, 0, 0, 0});
+            }
+        }
+        return ok;
+    }
+
+    void controlEvent(int handle, unsigned long request) override { inner->controlEvent(handle, request); }
+
+    void closeEvent(int handle) override {
+        inner->closeEvent(handle);
+        std::lock_guard<std::mutex> guard(mutex);
+        counter_of.erase(handle);
+    }
+
+private:
+    void append(const PerfRecordingEntry& entry) {
+        if (file) { fwrite(&entry, sizeof(entry), 1, file); }
+    }
+};
+
+/**
+ * Serves the values of a recording made with PerfRecordingBackend. The n-th open returns the n-th
+ * recorded open (including recorded failures), and each read returns the next recorded read of
+ * that counter, so a PerfEvent driven through the same sequence of regions reports the same numbers.
+ * A hardware counter recorded on a hybrid CPU was opened once per core PMU; replayed on a host
+ * without these PMUs, one open takes all recorded parts and reads return their sum like PerfEvent.
+ * */
+struct PerfReplayBackend : PerfBackend {
+    struct Counter {
+        PerfRecordingEntry open;
+        std::deque<PerfRecordingEntry> reads;
+    };
+    std::mutex mutex;
+    std::vector<Counter> counters;
+    size_t next = 0;
+    std::map<int, std::vector<size_t>> parts;  // handle -> recorded counters of a merged open
+
+    explicit PerfReplayBackend(const std::string& path) {
+        FILE* file = fopen(path.c_str(), "rbe");
+        uint32_t magic = 0;
+        if (!file || fread(&magic, sizeof(magic), 1, file) != 1 || magic != PerfRecordingEntry::magic) {
+            std::cerr << "Not a counter recording: " << path << std::endl;
+            if (file) { fclose(file); }
+            return;
+        }
+        PerfRecordingEntry entry;
+        while (fread(&entry, sizeof(entry), 1, file) == 1) {
+            if (entry.kind == PerfRecordingEntry::OPEN || entry.kind == PerfRecordingEntry::OPEN_FAILED) {
+                counters.resize(std::max<size_t>(counters.size(), entry.counter + 1));
+                counters[entry.counter].open = entry;
+            } else if (entry.counter < counters.size()) {
+                counters[entry.counter].reads.push_back(entry);
+            }
+        }
+        fclose(file);
+    }
+
+    // the config without the PMU of a hybrid CPU's hardware counter
+    static uint64_t baseConfig(uint64_t type, uint64_t config) {
+        bool hardware = type == PERF_TYPE_HARDWARE || type == PERF_TYPE_HW_CACHE;
+        return hardware ? config & ((1ull << PERF_PMU_TYPE_SHIFT) - 1) : config;
+    }
+
+    // a counter is supported if the recording ever tried to open it, on any PMU
+    bool supports(const perf_event_attr& pe) override {
+        for (auto& counter : counters) {
+            if (counter.open.a == pe.type && baseConfig(counter.open.a, counter.open.b) == baseConfig(pe.type, pe.config)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    int openEvent(perf_event_attr& pe, pid_t, int, int, unsigned long) override {
+        std::lock_guard<std::mutex> guard(mutex);
+        uint64_t base = baseConfig(pe.type, pe.config);
+        if (next == counters.size() || counters[next].open.a != pe.type ||
+            baseConfig(counters[next].open.a, counters[next].open.b) != base) {
+            std::cerr << "Replay diverged from the recording at open " << next << std::endl;
+            errno = EINVAL;
+            return -1;
+        }
+        if (counters[next].open.b == pe.config) {
+            auto& open = counters[next].open;
+            if (open.kind == PerfRecordingEntry::OPEN_FAILED) {
+                next++;
+                errno = static_cast<int>(open.c);
+                return -1;
+            }
+            return static_cast<int>(next++);
+        }
+        // the recorded parts follow each other, one per PMU, until the next target starts over
+        int handle = static_cast<int>(next);
+        std::vector<size_t> merged;
+        std::vector<uint64_t> pmus;
+        int error = 0;
+        for (; next < counters.size(); next++) {
+            auto& open = counters[next].open;
+            uint64_t pmu = open.b >> PERF_PMU_TYPE_SHIFT;
+            if (open.a != pe.type || baseConfig(open.a, open.b) != base || open.b == pe.config ||
+                std::find(pmus.begin(), pmus.end(), pmu) != pmus.end()) {
+                break;
+            }
+            pmus.push_back(pmu);
+            merged.push_back(next);
+            if (open.kind == PerfRecordingEntry::OPEN_FAILED) { error = static_cast<int>(open.c); }
+        }
+        if (error) {
+            errno = error;
+            return -1;
+        }
+        parts[handle] = merged;
+        return handle;
+    }
+
+    bool readEvent(int handle, PerfReadFormat& out) override {
+        std::lock_guard<std::mutex> guard(mutex);
+        auto merged = parts.find(handle);
+        if (merged == parts.end()) { return readRecorded(handle, out); }
+        // summed like PerfEvent sums the parts of one target
+        PerfReadFormat sum{};
+        for (size_t counter : merged->second) {
+            PerfReadFormat part;
+            if (!readRecorded(static_cast<int>(counter), part)) { return false; }
+            sum.value += part.value;
+            sum.time_enabled = std::max(sum.time_enabled, part.time_enabled);
+            sum.time_running += part.time_running;
+        }
+        out = sum;
+        return true;
+    }
+
+    void controlEvent(int, unsigned long) override {}
+
+    void closeEvent(int handle) override {
+        std::lock_guard<std::mutex> guard(mutex);
+        parts.erase(handle);
+    }
+
+private:
+    bool readRecorded(int handle, PerfReadFormat& out) {
+        if (handle < 0 || static_cast<size_t>(handle) >= counters.size() || counters[handle].reads.empty()) {
+            return false;
+        }
+        auto entry = counters[handle].reads.front();
+        counters[handle].reads.pop_front();
+        out.value = entry.a;
+        out.time_enabled = entry.b;
+        out.time_running = entry.c;
+        return entry.kind == PerfRecordingEntry::READ;
+    }
+};
+
+// the syscalls where perf_event_open works and the software clocks where counters cannot be opened
+// at all; with calling_thread_only, which stops counting child threads, rdpmc where user-space
+// counter reads are allowed
+inline std::shared_ptr<PerfBackend> cheapestPerfBackend(bool calling_thread_only = false) {
+    if (calling_thread_only && PerfRdpmcBackend::available()) { return std::make_shared<PerfRdpmcBackend>(true); }
+    perf_event_attr pe = {};
+    pe.type = PERF_TYPE_SOFTWARE;
+    pe.size = sizeof(pe);
+    pe.config = PERF_COUNT_SW_TASK_CLOCK;
+    pe.exclude_kernel = 1;
+    int fd = static_cast<int>(syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0));
+    if (fd < 0) { return std::make_shared<PerfSoftwareBackend>(); }
+    close(fd);
+    return std::make_shared<PerfSyscallBackend>();
+}
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <linux/hw_breakpoint.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <ostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "PerfJit.hpp"
+#include "PerfSampling.hpp"
+
+/**
+ * Finds contended cache lines, c2c-style: samples memory accesses with their data address, groups
+ * them by 64-byte line and ranks the lines by HITM (loads that hit a line modified in another core's
+ * cache), naming the reading and writing functions. Several threads touching different offsets
+ * of a line points to false sharing, one offset to true sharing.
+ *
+ *   // after starting the workers, the addresses are only watched without memory sampling events, and
+ *   // like all samplers only in threads that exist at construction and threads they start later
+ *   e.extensions.push_back(std::make_shared<PerfContention>(&std::cout, PerfContention::Watches{{&q.head}, {&q.tail}}));
+ *
+ *   cache line,        hitm,  loads, stores, threads, offsets, symbol
+ *   0x5581f2a4c040,     412,   1290,    388,       8,       2, queue
+ *       pop(),           hitm 380, loads 1201, stores 190
+ *
+ * Uses the mem-loads/mem-stores events of Intel CPUs or AMD IBS when the kernel accepts them. CPUs
+ * whose mem-loads needs the mem-loads-aux group leader (e.g. Sapphire Rapids) and hosts without
+ * these events fall back to write breakpoints on the given addresses, sampling every write, which
+ * shows which threads and functions write a line but not the HITMs. x86 has four breakpoints.
+ * */
+struct PerfContention : PerfSampler {
+    struct Watch {
+        const void* addr;
+        uint8_t len = 8;  // 1, 2, 4 or 8 bytes
+    };
+    using Watches = std::vector<Watch>;
+
+    struct Access {
+        std::string function;
+        uint64_t loads = 0;
+        uint64_t stores = 0;
+        uint64_t hitm = 0;
+    };
+
+    struct Line {
+        uint64_t address = 0;
+        uint64_t loads = 0;
+        uint64_t stores = 0;
+        uint64_t hitm = 0;
+        std::set<uint32_t> threads;
+        std::set<uint32_t> writers;
+        uint64_t offsets = 0;            // bit i set if byte i of the line was accessed
+        std::vector<Access> functions;   // by total accesses, only for ranked lines
+        std::map<uint64_t, Access> ips;  // while aggregating
+    };
+
+    std::ostream* out;
+    unsigned top;
+    bool breakpoints;         // the fallback is active
+    std::vector<Line> lines;  // the `top` most contended lines of the last region
+
+    explicit PerfContention(std::ostream* out = nullptr, const Watches& fallback = {}, unsigned top = 10)
+        : PerfSampler(chooseOptions(fallback)), out(out), top(top),
+          breakpoints(!options.counters.empty() && options.counters[0].type == PERF_TYPE_BREAKPOINT) {}
+
+    // memory sampling events if this host has them, otherwise breakpoints on `fallback`
+    static PerfSamplerOptions chooseOptions(const Watches& fallback) {
+        PerfSamplerOptions options;
+        options.all_threads = true;
+        options.keep_samples = false;  // aggregated by cache line in decoded()
+        options.sample_type = PERF_SAMPLE_ADDR | PERF_SAMPLE_WEIGHT | PERF_SAMPLE_DATA_SRC;
+        options.counters.clear();
+        // every core PMU, a hybrid CPU's P-cores (cpu_core) and E-cores (cpu_atom) each sample their own accesses
+        for (const char* pmu : {"cpu", "cpu_core", "cpu_atom"}) {
+            PerfSampleCounter loads, stores;
+            // 30 cycles like perf c2c, cheaper loads cannot be HITMs
+            if (PerfSampleCounter::fromSysfs(pmu, "mem-loads", loads, "ldlat=30")) {
+                loads.precise_ip = 3;
+                if (probe(loads, options)) { options.counters.push_back(loads); }
+            }
+            if (PerfSampleCounter::fromSysfs(pmu, "mem-stores", stores)) {
+                stores.precise_ip = 3;
+                if (probe(stores, options)) { options.counters.push_back(stores); }
+            }
+        }
+        if (!options.counters.empty()) { return options; }
+        PerfSampleCounter ibs{"ibs_op", 0, 0};
+        std::ifstream ibsType(PerfEvent::sysfsRoot() + "/bus/event_source/devices/ibs_op/type");
+        if (ibsType >> ibs.type && probe(ibs, options)) {
+            options.counters.push_back(ibs);
+            return options;
+        }
+
+        options.sample_type = PERF_SAMPLE_ADDR;
+        if (fallback.empty()) { std::cerr << "No memory sampling events available and no addresses to watch" << std::endl; }
+        if (fallback.size() > 4) { std::cerr << "Watching more than 4 addresses may exceed the debug registers" << std::endl; }
+        for (auto& watch : fallback) {
+            char name[32];
+            snprintf(name, sizeof(name), "write %p", watch.addr);
+            PerfSampleCounter write{name, PERF_TYPE_BREAKPOINT, 0};
+            write.period = 1;
+            write.bp_type = HW_BREAKPOINT_W;
+            write.config1 = reinterpret_cast<uintptr_t>(watch.addr);
+            write.config2 = watch.len;
+            options.counters.push_back(write);
+        }
+        return options;
+    }
+
+    void stop(PerfEvent& e) override {
+        PerfSampler::stop(e);
+        {
+            std::lock_guard<std::mutex> guard(samples_mutex);
+            rank();
+        }
+        if (out) { print(*out); }
+    }
+
+    void print(std::ostream& os) const {
+        os << std::left << std::setw(16) << "cache line," << std::right << std::setw(8) << "hitm," << std::setw(8) << "loads,"
+           << std::setw(8) << "stores," << std::setw(9) << "threads," << std::setw(9) << "offsets," << " symbol" << std::endl;
+        for (auto& line : lines) {
+            char address[24];
+            snprintf(address, sizeof(address), "0x%lx,", static_cast<unsigned long>(line.address));
+            std::string symbol = PerfJit::symbolize(reinterpret_cast<const void*>(line.address));
+            os << std::left << std::setw(16) << address << std::right << std::setw(7) << line.hitm << "," << std::setw(7)
+               << line.loads << "," << std::setw(7) << line.stores << "," << std::setw(8) << line.threads.size() << ","
+               << std::setw(8) << __builtin_popcountll(line.offsets) << ", " << (symbol.compare(0, 2, "0x") ? symbol : "") << std::endl;
+            for (auto& access : line.functions) {
+                os << "    " << std::left << std::setw(24) << access.function + "," << std::right << " hitm " << access.hitm
+                   << ", loads " << access.loads << ", stores " << access.stores << std::endl;
+            }
+        }
+    }
+
+protected:
+    void cleared() override { pending.clear(); }
+
+    void decoded(PerfSample& s) override {
+        if (!s.addr) { return; }
+        auto& line = pending[s.addr & ~uint64_t(63)];
+        line.address = s.addr & ~uint64_t(63);
+        bool store = breakpoints || options.counters[s.counter].name == "mem-stores" ||
+                     ((s.data_src >> PERF_MEM_OP_SHIFT) & PERF_MEM_OP_STORE);
+        bool hitm = !store && ((s.data_src >> PERF_MEM_SNOOP_SHIFT) & PERF_MEM_SNOOP_HITM);
+#ifdef PERF_MEM_SNOOPX_PEER
+        // AMD reports cache-to-cache transfers as peer snoops
+        hitm = hitm || (!store && ((s.data_src >> PERF_MEM_SNOOPX_SHIFT) & PERF_MEM_SNOOPX_PEER));
+#endif
+        auto& access = line.ips[s.ip];
+        (store ? line.stores : line.loads)++;
+        (store ? access.stores : access.loads)++;
+        line.hitm += hitm;
+        access.hitm += hitm;
+        line.threads.insert(s.tid);
+        if (store) { line.writers.insert(s.tid); }
+        line.offsets |= 1ull << (s.addr & 63);
+    }
+
+private:
+    std::map<uint64_t, Line> pending;
+
+    // HITMs first, then lines written by the most threads; only the top lines are symbolized
+    void rank() {
+        lines.clear();
+        for (auto& entry : pending) {
+            if (entry.second.hitm || entry.second.writers.size() > 1 || (breakpoints && entry.second.stores)) {
+                lines.push_back(std::move(entry.second));
+            }
+        }
+        pending.clear();
+        auto before = [](const Line& a, const Line& b) {
+            if (a.hitm != b.hitm) { return a.hitm > b.hitm; }
+            if (a.writers.size() != b.writers.size()) { return a.writers.size() > b.writers.size(); }
+            return a.stores > b.stores;
+        };
+        std::sort(lines.begin(), lines.end(), before);
+        if (lines.size() > top) { lines.resize(top); }
+        for (auto& line : lines) {
+            std::map<std::string, Access> functions;
+            for (auto& ip : line.ips) {
+                auto& f = functions[PerfJit::symbolize(reinterpret_cast<const void*>(ip.first))];
+                f.loads += ip.second.loads;
+                f.stores += ip.second.stores;
+                f.hitm += ip.second.hitm;
+            }
+            line.ips.clear();
+            for (auto& f : functions) {
+                f.second.function = f.first;
+                line.functions.push_back(f.second);
+            }
+            std::sort(line.functions.begin(), line.functions.end(), [](const Access& a, const Access& b) {
+                return a.hitm + a.loads + a.stores > b.hitm + b.loads + b.stores;
+            });
+            if (line.functions.size() > 5) { line.functions.resize(5); }
+        }
+    }
+};
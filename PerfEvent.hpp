@@ -27,73 +27,615 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #if defined(__linux__)
 
+#include <algorithm>
+#include <cerrno>
 #include <chrono>
+#include <csignal>
 #include <cstring>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
 #include <vector>
 
 #include <asm/unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/hw_breakpoint.h>
 #include <linux/perf_event.h>
 #include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#ifndef PERF_PMU_TYPE_SHIFT
+// extended type encoding of PERF_TYPE_HARDWARE/PERF_TYPE_HW_CACHE configs, Linux 5.13+
+#define PERF_PMU_TYPE_SHIFT 32
+#endif
+
+struct PerfReadFormat {
+   uint64_t value;
+   uint64_t time_enabled;
+   uint64_t time_running;
+   uint64_t id;
+};
+
+// Where PerfEvent gets its counter values from. The default issues the perf syscalls directly;
+// PerfBackends.hpp adds an rdpmc fast path, software-only clocks, and record/replay. Handles
+// returned by openEvent are only passed back to the same backend.
+struct PerfBackend {
+   virtual ~PerfBackend() = default;
+   // counters a backend cannot provide are dropped instead of failing the whole PerfEvent
+   virtual bool supports(const perf_event_attr&) { return true; }
+   // same contract as perf_event_open: a handle, or -1 with errno set
+   virtual int openEvent(perf_event_attr& pe, pid_t pid, int cpu, int groupFd, unsigned long flags) = 0;
+   virtual bool readEvent(int handle, PerfReadFormat& out) = 0;
+   virtual void controlEvent(int handle, unsigned long request) = 0;
+   virtual void closeEvent(int handle) = 0;
+
+   // used by every PerfEvent constructed afterwards that is not given a backend explicitly
+   static std::shared_ptr<PerfBackend>& defaultBackend();
+};
+
+struct PerfSyscallBackend : PerfBackend {
+   int openEvent(perf_event_attr& pe, pid_t pid, int cpu, int groupFd, unsigned long flags) override {
+      // children forked by runAndMeasure or the application must not inherit the counter fds
+      return static_cast<int>(syscall(__NR_perf_event_open, &pe, pid, cpu, groupFd, flags | PERF_FLAG_FD_CLOEXEC));
+   }
+
+   bool readEvent(int handle, PerfReadFormat& out) override {
+      return read(handle, &out, sizeof(uint64_t) * 3) == sizeof(uint64_t) * 3;
+   }
+
+   void controlEvent(int handle, unsigned long request) override {
+      ioctl(handle, request, 0);
+   }
+
+   void closeEvent(int handle) override {
+      close(handle);
+   }
+};
+
+inline std::shared_ptr<PerfBackend>& PerfBackend::defaultBackend() {
+   static std::shared_ptr<PerfBackend> backend = std::make_shared<PerfSyscallBackend>();
+   return backend;
+}
+
 struct PerfEvent {
 
+   // One core PMU of a hybrid CPU, e.g. cpu_core and cpu_atom on Intel Alder Lake
+   struct CorePmu {
+      std::string name;
+      uint32_t type;         // for the extended type in the upper config bits
+      std::vector<int> cpus;
+   };
+
    struct event {
-      struct read_format {
-         uint64_t value;
-         uint64_t time_enabled;
-         uint64_t time_running;
-         uint64_t id;
+      using read_format = PerfReadFormat;
+      // target and core PMU (index into parts) of each fd
+      struct FdOrigin {
+         unsigned target;
+         unsigned part;
       };
 
       perf_event_attr pe;
-      int fd;
+      uint8_t priority;     // CounterPriority
+      PerfBackend* backend;
+      std::vector<int> fds; // backend handles, one per target and part, summed on read
+      std::vector<FdOrigin> origins;
       read_format prev;
       read_format data;
+      // On hybrid CPUs generic hardware counters are opened once per core PMU, otherwise empty.
+      // The per-PMU values are kept (unscaled) in partsPrev/partsData.
+      std::vector<CorePmu> parts;
+      std::vector<read_format> partsPrev;
+      std::vector<read_format> partsData;
 
       double readCounter() {
-         double multiplexingCorrection = static_cast<double>(data.time_enabled - prev.time_enabled) / static_cast<double>(data.time_running - prev.time_running);
-         return static_cast<double>(data.value - prev.value) * multiplexingCorrection;
+         return delta(prev, data);
+      }
+
+      // raw value since the last reset, without multiplexing correction or floating point math
+      uint64_t readCounterCheap() {
+         return data.value;
+      }
+
+      // multiplexing-corrected difference between two reads of the same counter
+      static double delta(const read_format& from, const read_format& to) {
+         double multiplexingCorrection = static_cast<double>(to.time_enabled - from.time_enabled) / static_cast<double>(to.time_running - from.time_running);
+         return static_cast<double>(to.value - from.value) * multiplexingCorrection;
+      }
+
+      // Sums all fds. The parts of one task target each run only while the task is on their core
+      // type but are enabled all the time, so their running times add up and only the largest
+      // enabled time counts, which keeps the multiplexing correction at 1 without multiplexing.
+      bool readInto(read_format& out, std::vector<read_format>* perPart = nullptr) {
+         out = read_format();
+         if (perPart)
+            perPart->assign(parts.size(), read_format());
+         uint64_t targetEnabled = 0;
+         for (unsigned i=0; i<fds.size(); i++) {
+            read_format r;
+            if (!backend->readEvent(fds[i], r))
+               return false;
+            if (i && origins[i].target != origins[i - 1].target) {
+               out.time_enabled += targetEnabled;
+               targetEnabled = 0;
+            }
+            out.value += r.value;
+            out.time_running += r.time_running;
+            targetEnabled = std::max(targetEnabled, r.time_enabled);
+            if (perPart && origins[i].part < perPart->size()) {
+               auto& part = (*perPart)[origins[i].part];
+               part.value += r.value;
+               part.time_enabled += r.time_enabled;
+               part.time_running += r.time_running;
+            }
+         }
+         out.time_enabled += targetEnabled;
+         return true;
+      }
+
+      void control(unsigned long request) {
+         for (int fd : fds)
+            backend->controlEvent(fd, request);
       }
    };
 
+   // A (pid, cpu) pair passed to perf_event_open, every counter is opened once per target
+   struct Target {
+      pid_t pid;
+      int cpu;
+      unsigned long flags;
+   };
+
    enum EventDomain : uint8_t { USER = 0b1, KERNEL = 0b10, HYPERVISOR = 0b100, ALL = 0b111 };
+   // when file descriptors run out, counters are dropped lowest priority first, ESSENTIAL ones never
+   enum CounterPriority : uint8_t { LOW, MEDIUM, HIGH, ESSENTIAL };
+   // accesses counted by watch(); x86 cannot trap reads only, so use RW there
+   enum WatchType : uint8_t { R = HW_BREAKPOINT_R, W = HW_BREAKPOINT_W, RW = HW_BREAKPOINT_RW };
 
    std::vector<event> events;
    std::vector<std::string> names;
+   std::vector<std::string> droppedCounters; // optional counters that did not fit the fd budget
    std::chrono::time_point<std::chrono::steady_clock> startTime;
    std::chrono::time_point<std::chrono::steady_clock> stopTime;
 
+   std::vector<Target> targets;
+   std::shared_ptr<PerfBackend> backend = PerfBackend::defaultBackend();
+   // print one extra column per core PMU for counters split on hybrid CPUs
+   bool reportPerPmu = false;
+
+   // Notified around every measured region, e.g. to feed exporters. Extensions start before and
+   // stop after the counters so that their own work is not measured.
+   struct Extension {
+      virtual ~Extension() = default;
+      virtual void start(PerfEvent&) {}
+      virtual void stop(PerfEvent&) {}
+      // appends extra columns to printReport, values normalized like the counters
+      virtual void report(PerfEvent&, std::ostream&, std::ostream&, uint64_t) {}
+   };
+
+   std::vector<std::shared_ptr<Extension>> extensions;
+
+   // Start and stop with prctl(PR_TASK_PERF_EVENTS_ENABLE/DISABLE) instead of ioctls. This toggles
+   // every counter the opening thread owns (e.g. one PerfEvent per worker tid, all constructed by
+   // the same thread) with a single syscall, so region boundaries cost the same for any number of
+   // threads and counters and are not skewed across them. Only effective on the opening thread.
+   bool processWideToggle = false;
+   pid_t owner = 0;
+
+   // count the calling process
    PerfEvent() {
+      registerDefaultCounters();
+      targets.push_back({0, -1, 0});
+      openCounters();
+   }
+
+   // count the calling process through a specific backend, e.g. a PerfReplayBackend
+   explicit PerfEvent(std::shared_ptr<PerfBackend> backend) : backend(std::move(backend)) {
+      registerDefaultCounters();
+      targets.push_back({0, -1, 0});
+      openCounters();
+   }
+
+   // count another process (all threads currently in /proc/<pid>/task, threads they spawn later are
+   // picked up via inherit) or, with allThreads=false, only the single thread with this tid
+   explicit PerfEvent(pid_t pid, bool allThreads = true) {
+      registerDefaultCounters();
+      for (pid_t tid : (allThreads ? listThreads(pid) : std::vector<pid_t>{pid}))
+         targets.push_back({tid, -1, 0});
+      if (targets.empty()) {
+         std::cerr << "Error listing threads of process " << pid << std::endl;
+         events.resize(0);
+         names.resize(0);
+         return;
+      }
+      openCounters();
+   }
+
+   struct Cgroup {
+      std::string path; // cgroup v2 directory, e.g. /sys/fs/cgroup/system.slice/db.service
+   };
+
+   // the pid of all cgroup targets, kept open so that counters can be opened on them later
+   int cgroupFd = -1;
+
+   // per-cpu events cannot inherit, and task-clock only exists for tasks
+   static void countPerCpu(perf_event_attr& pe) {
+      pe.inherit = 0;
+      if (pe.type == PERF_TYPE_SOFTWARE && pe.config == PERF_COUNT_SW_TASK_CLOCK)
+         pe.config = PERF_COUNT_SW_CPU_CLOCK;
+   }
+
+   // count all processes of a cgroup on all online cpus
+   explicit PerfEvent(const Cgroup& cgroup) {
+      registerDefaultCounters();
+      for (auto& event : events)
+         countPerCpu(event.pe);
+      cgroupFd = open(cgroup.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (cgroupFd < 0) {
+         std::cerr << "Error opening cgroup " << cgroup.path << std::endl;
+         events.resize(0);
+         names.resize(0);
+         return;
+      }
+      for (int cpu : onlineCpus())
+         targets.push_back({cgroupFd, cpu, PERF_FLAG_PID_CGROUP});
+      openCounters();
+   }
+
+   // fds of one counter configuration, shared by all PerfEvent(Shared) instances that use it
+   struct SharedCounters {
+      std::shared_ptr<PerfBackend> backend;
+      std::vector<std::string> names;    // counters that were opened, without the dropped ones
+      std::vector<std::vector<int>> fds; // per event
+      std::vector<std::vector<event::FdOrigin>> origins;
+      std::mutex mutex;
+      unsigned active = 0;               // instances between startCounters and stopCounters
+
+      ~SharedCounters() {
+         for (auto& eventFds : fds)
+            for (int fd : eventFds)
+               backend->closeEvent(fd);
+      }
+   };
+
+   std::shared_ptr<SharedCounters> shared;
+   bool lazy = false;
+   bool sharedRunning = false;        // counted in shared->active
+
+   struct Shared {};
+
+   // Counts the calling thread like PerfEvent(), but construction opens nothing. The first
+   // startCounters takes the fds from a process-wide, reference-counted context, which all shared
+   // instances with the same counters on the same thread reuse; each instance only snapshots its own
+   // start and stop values, and the counters stay enabled while any instance is running.
+   explicit PerfEvent(Shared) : lazy(true) {
+      registerDefaultCounters();
+      targets.push_back({0, -1, 0});
+   }
+
+   PerfEvent(const PerfEvent&) = delete;
+   PerfEvent& operator=(const PerfEvent&) = delete;
+
+   void registerDefaultCounters() {
       registerCounter("cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
-      registerCounter("kcycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, KERNEL);
+      registerCounter("kcycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, KERNEL, LOW);
       registerCounter("instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
-      registerCounter("L1-misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D|(PERF_COUNT_HW_CACHE_OP_READ<<8)|(PERF_COUNT_HW_CACHE_RESULT_MISS<<16));
-      registerCounter("LLC-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
-      registerCounter("branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+      registerCounter("L1-misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D|(PERF_COUNT_HW_CACHE_OP_READ<<8)|(PERF_COUNT_HW_CACHE_RESULT_MISS<<16), ALL, MEDIUM);
+      registerCounter("LLC-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, ALL, HIGH);
+      registerCounter("branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, ALL, MEDIUM);
       registerCounter("task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK);
       // additional counters can be found in linux/perf_event.h
+   }
+
+   void openCounters() {
+      owner = static_cast<pid_t>(syscall(SYS_gettid));
+      for (unsigned i=0; i<events.size();) {
+         if (backend->supports(events[i].pe)) {
+            i++;
+            continue;
+         }
+         std::cerr << "Counter " << names[i] << " is not supported by the backend" << std::endl;
+         droppedCounters.push_back(names[i]);
+         events.erase(events.begin() + i);
+         names.erase(names.begin() + i);
+      }
+      size_t budget = fdBudget(fdsNeeded());
+      while (fdsNeeded() > budget && dropLowestPriority()) {}
+      while (!tryOpenCounters()) {}
+   }
+
+   size_t fdsNeeded() const {
+      size_t needed = 0;
+      for (auto& event : events)
+         needed += std::max<size_t>(1, event.parts.size()) * targets.size();
+      return needed;
+   }
 
+   // Opens one counter for one target, once per matching core PMU on hybrid CPUs. Returns false
+   // with errno set; fds opened so far are still appended and must be closed by the caller.
+   bool openCounter(event& event, unsigned targetIndex, std::vector<int>& fds, std::vector<event::FdOrigin>& origins) {
+      auto& target = targets[targetIndex];
+      if (event.parts.empty()) {
+         int fd = backend->openEvent(event.pe, target.pid, target.cpu, -1, target.flags);
+         if (fd < 0)
+            return false;
+         fds.push_back(fd);
+         origins.push_back({targetIndex, 0});
+         return true;
+      }
+      for (unsigned p=0; p<event.parts.size(); p++) {
+         auto& cpus = event.parts[p].cpus;
+         if (target.cpu >= 0 && std::find(cpus.begin(), cpus.end(), target.cpu) == cpus.end())
+            continue;
+         perf_event_attr pe = event.pe;
+         pe.config |= static_cast<uint64_t>(event.parts[p].type) << PERF_PMU_TYPE_SHIFT;
+         int fd = backend->openEvent(pe, target.pid, target.cpu, -1, target.flags);
+         if (fd < 0)
+            return false;
+         fds.push_back(fd);
+         origins.push_back({targetIndex, p});
+      }
+      return true;
+   }
+
+   // returns false if it ran out of fds and dropped a counter, the caller then retries
+   bool tryOpenCounters() {
       for (unsigned i=0; i<events.size(); i++) {
          auto& event = events[i];
-         event.fd = static_cast<int>(syscall(__NR_perf_event_open, &event.pe, 0, -1, -1, 0));
-         if (event.fd < 0) {
-            std::cerr << "Error opening counter " << names[i] << std::endl;
-            events.resize(0);
-            names.resize(0);
-            return;
+         for (unsigned t=0; t<targets.size(); t++) {
+            if (!openCounter(event, t, event.fds, event.origins)) {
+               if (threadExited(t) && targets.size() > 1) {
+                  // e.g. a short-lived worker that exited after listThreads, count the others
+                  closeCounters();
+                  targets.erase(targets.begin() + t);
+                  return false;
+               }
+               if (errno == EMFILE || errno == ENFILE) {
+                  closeCounters();
+                  if (dropLowestPriority())
+                     return false;
+               }
+               std::cerr << "Error opening counter " << names[i] << std::endl;
+               closeCounters();
+               events.resize(0);
+               names.resize(0);
+               return true;
+            }
+         }
+      }
+      return true;
+   }
+
+   // whether opening on a target failed because it is a thread that has exited since it was listed
+   bool threadExited(unsigned targetIndex) const {
+      auto& target = targets[targetIndex];
+      return errno == ESRCH && target.pid > 0 && !(target.flags & PERF_FLAG_PID_CGROUP);
+   }
+
+   bool dropLowestPriority() {
+      int lowest = -1;
+      for (unsigned i=0; i<events.size(); i++)
+         if (events[i].priority != ESSENTIAL && (lowest < 0 || events[i].priority <= events[lowest].priority))
+            lowest = static_cast<int>(i);
+      if (lowest < 0)
+         return false;
+      std::cerr << "Not enough file descriptors, dropping counter " << names[lowest] << std::endl;
+      for (int fd : events[lowest].fds)
+         backend->closeEvent(fd);
+      droppedCounters.push_back(names[lowest]);
+      events.erase(events.begin() + lowest);
+      names.erase(names.begin() + lowest);
+      return true;
+   }
+
+   // Number of fds that can still be opened while leaving some for the application. Tries to raise
+   // the soft RLIMIT_NOFILE up to the hard limit first if `needed` does not fit.
+   static size_t fdBudget(size_t needed) {
+      size_t open = countOpenFds();
+      rlimit limit;
+      if (getrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur == RLIM_INFINITY)
+         return needed;
+      if (open + needed + 64 > limit.rlim_cur && limit.rlim_cur < limit.rlim_max) {
+         rlimit raised = limit;
+         raised.rlim_cur = std::min<rlim_t>(limit.rlim_max, open + needed + 64);
+         if (setrlimit(RLIMIT_NOFILE, &raised) == 0)
+            limit = raised;
+      }
+      size_t reserve = std::min<size_t>(64, limit.rlim_cur / 4);
+      return limit.rlim_cur > open + reserve ? limit.rlim_cur - open - reserve : 0;
+   }
+
+   static size_t countOpenFds() {
+      size_t count = 0;
+      DIR* dir = opendir("/proc/self/fd");
+      if (!dir)
+         return 0;
+      while (dirent* entry = readdir(dir))
+         count += entry->d_name[0] != '.';
+      closedir(dir);
+      return count;
+   }
+
+   void closeCounters() {
+      if (shared) {
+         if (sharedRunning) {
+            // destroyed between start and stop, release this instance's reference on the enabled state
+            std::lock_guard<std::mutex> guard(shared->mutex);
+            if (shared->active && --shared->active == 0)
+               for (auto& event : events)
+                  event.control(PERF_EVENT_IOC_DISABLE);
+            sharedRunning = false;
+         }
+         for (auto& event : events) {
+            event.fds.clear();
+            event.origins.clear();
          }
+         shared.reset();
+         return;
+      }
+      for (auto& event : events) {
+         for (int fd : event.fds)
+            backend->closeEvent(fd);
+         event.fds.clear();
+         event.origins.clear();
       }
    }
 
-   void registerCounter(const std::string& name, uint64_t type, uint64_t eventID, EventDomain domain = ALL) {
+   void acquireSharedCounters() {
+      lazy = false;
+      // pid 0 means the opening thread, so each thread gets its own context
+      std::string key = std::to_string(reinterpret_cast<uintptr_t>(backend.get())) + ':';
+      pid_t tid = static_cast<pid_t>(syscall(SYS_gettid));
+      for (auto& target : targets) {
+         Target resolved = target;
+         if (!resolved.pid && !(resolved.flags & PERF_FLAG_PID_CGROUP))
+            resolved.pid = tid;
+         key.append(reinterpret_cast<const char*>(&resolved), sizeof(resolved));
+      }
+      for (unsigned i=0; i<events.size(); i++) {
+         key.append(reinterpret_cast<const char*>(&events[i].pe), sizeof(perf_event_attr));
+         key += names[i];
+         key += '\0';
+      }
+
+      static std::mutex registryMutex;
+      static std::map<std::string, std::weak_ptr<SharedCounters>> registry;
+      // keeps the last context of each thread open, so sequential blocks do not reopen it
+      static thread_local std::shared_ptr<SharedCounters> lastUsed;
+      std::lock_guard<std::mutex> guard(registryMutex);
+      shared = registry[key].lock();
+      if (shared) {
+         owner = tid;
+         // the key holds all registered counters, drop the ones the opening instance had to drop
+         for (unsigned i=0; i<events.size();) {
+            if (i < shared->names.size() && names[i] == shared->names[i]) {
+               events[i].fds = shared->fds[i];
+               events[i].origins = shared->origins[i];
+               i++;
+               continue;
+            }
+            droppedCounters.push_back(names[i]);
+            events.erase(events.begin() + i);
+            names.erase(names.begin() + i);
+         }
+         lastUsed = shared;
+         return;
+      }
+      openCounters();
+      if (events.empty()) {
+         registry.erase(key);
+         return;
+      }
+      auto counters = std::make_shared<SharedCounters>();
+      counters->backend = backend;
+      counters->names = names;
+      for (auto& event : events) {
+         counters->fds.push_back(event.fds);
+         counters->origins.push_back(event.origins);
+      }
+      shared = counters;
+      lastUsed = counters;
+      registry[key] = counters;
+      for (auto it = registry.begin(); it != registry.end();)
+         it = it->second.expired() ? registry.erase(it) : std::next(it);
+   }
+
+   // where onlineCpus and hybridPmus look for sysfs, can point to a fake tree in tests
+   static std::string& sysfsRoot() {
+      static std::string root = "/sys";
+      return root;
+   }
+
+   static std::vector<int> onlineCpus() {
+      std::ifstream in(sysfsRoot() + "/devices/system/cpu/online");
+      return parseCpuList(in);
+   }
+
+   // parses a cpu list like "0-7,16-23"
+   static std::vector<int> parseCpuList(std::istream& in) {
+      std::vector<int> cpus;
+      std::string range;
+      while (std::getline(in, range, ',')) {
+         auto dash = range.find('-');
+         int first = std::stoi(range.substr(0, dash));
+         int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+         for (int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+      }
+      return cpus;
+   }
+
+   // Core PMUs of a hybrid CPU, i.e. the event sources in <root>/bus/event_source/devices that
+   // list their CPUs in a `cpus` file. Empty on CPUs with a single core type.
+   static std::vector<CorePmu> discoverHybridPmus(const std::string& root) {
+      std::vector<CorePmu> pmus;
+      std::string devices = root + "/bus/event_source/devices";
+      DIR* dir = opendir(devices.c_str());
+      if (!dir)
+         return pmus;
+      while (dirent* entry = readdir(dir)) {
+         if (entry->d_name[0] == '.')
+            continue;
+         std::string path = devices + "/" + entry->d_name;
+         std::ifstream type(path + "/type");
+         std::ifstream cpus(path + "/cpus");
+         CorePmu pmu{entry->d_name, 0, {}};
+         if (!(type >> pmu.type) || !cpus)
+            continue;
+         pmu.cpus = parseCpuList(cpus);
+         pmus.push_back(pmu);
+      }
+      closedir(dir);
+      if (pmus.size() < 2)
+         return {};
+      std::sort(pmus.begin(), pmus.end(), [](const CorePmu& a, const CorePmu& b) { return a.name < b.name; });
+      return pmus;
+   }
+
+   // discoverHybridPmus(sysfsRoot()), scanned once per root
+   static std::vector<CorePmu> hybridPmus() {
+      static std::mutex mutex;
+      static std::string scannedRoot;
+      static std::vector<CorePmu> pmus;
+      static bool scanned = false;
+      std::lock_guard<std::mutex> guard(mutex);
+      if (!scanned || scannedRoot != sysfsRoot()) {
+         pmus = discoverHybridPmus(sysfsRoot());
+         scannedRoot = sysfsRoot();
+         scanned = true;
+      }
+      return pmus;
+   }
+
+   static std::vector<pid_t> listThreads(pid_t pid) {
+      std::vector<pid_t> tids;
+      std::string path = "/proc/" + std::to_string(pid) + "/task";
+      DIR* dir = opendir(path.c_str());
+      if (!dir)
+         return tids;
+      while (dirent* entry = readdir(dir)) {
+         if (entry->d_name[0] >= '0' && entry->d_name[0] <= '9')
+            tids.push_back(static_cast<pid_t>(std::stoi(entry->d_name)));
+      }
+      closedir(dir);
+      return tids;
+   }
+
+   void registerCounter(const std::string& name, uint64_t type, uint64_t eventID, EventDomain domain = ALL, CounterPriority priority = ESSENTIAL) {
       names.push_back(name);
       events.push_back(event());
       auto& event = events.back();
+      event.priority = priority;
+      event.backend = backend.get();
       auto& pe = event.pe;
       memset(&pe, 0, sizeof(struct perf_event_attr));
       pe.type = static_cast<uint32_t>(type);
@@ -106,33 +648,262 @@ struct PerfEvent {
       pe.exclude_kernel = !(domain & KERNEL);
       pe.exclude_hv = !(domain & HYPERVISOR);
       pe.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      // generic hardware events only count on one core type of a hybrid CPU unless opened per PMU
+      if ((type == PERF_TYPE_HARDWARE || type == PERF_TYPE_HW_CACHE) && !(eventID >> PERF_PMU_TYPE_SHIFT))
+         event.parts = hybridPmus();
+   }
+
+   // Adds a counter after construction and opens it for all targets, between regions only. Unlike
+   // the constructor, a counter that cannot be opened is only reported and removed again, so
+   // optional counters (e.g. dTLB misses, which not every CPU provides) cannot disable the others.
+   bool addCounter(const std::string& name, uint64_t type, uint64_t eventID, EventDomain domain = ALL, CounterPriority priority = LOW) {
+      registerCounter(name, type, eventID, domain, priority);
+      return openAddedCounter();
+   }
+
+   // Counts user-space accesses to [addr, addr+len) with a hardware breakpoint, reported like any
+   // other counter (default name e.g. "W@0x5581f2a4c040"). len is 1, 2, 4 or 8 and addr must be
+   // aligned to it. Each breakpoint takes a debug register in every counted thread, x86 has four.
+   bool watch(const void* addr, uint64_t len, WatchType type = W, std::string name = "") {
+      if (name.empty()) {
+         std::stringstream stream;
+         stream << (type == R ? "R" : type == W ? "W" : "RW") << "@" << addr;
+         name = stream.str();
+      }
+      registerCounter(name, PERF_TYPE_BREAKPOINT, 0, USER, ESSENTIAL);
+      auto& pe = events.back().pe;
+      pe.bp_type = type;
+      pe.bp_addr = reinterpret_cast<uintptr_t>(addr);
+      pe.bp_len = len;
+      return openAddedCounter();
+   }
+
+   // opens the counter registered last, e.g. after adjusting its perf_event_attr
+   bool openAddedCounter() {
+      unsigned i = static_cast<unsigned>(events.size() - 1);
+      auto& event = events[i];
+      if (cgroupFd >= 0)
+         countPerCpu(event.pe);
+      bool opened = !shared && backend->supports(event.pe);
+      if (shared)
+         std::cerr << "Counter " << names[i] << " cannot be added to shared counters that are in use" << std::endl;
+      else if (!opened)
+         std::cerr << "Counter " << names[i] << " is not supported by the backend" << std::endl;
+      // lazy instances open all counters on the first start
+      for (unsigned t=0; opened && !lazy && t<targets.size(); t++) {
+         if (!openCounter(event, t, event.fds, event.origins) && !threadExited(t)) {
+            std::cerr << "Error opening counter " << names[i] << std::endl;
+            opened = false;
+         }
+      }
+      if (opened)
+         return true;
+      for (int fd : event.fds)
+         backend->closeEvent(fd);
+      droppedCounters.push_back(names[i]);
+      events.pop_back();
+      names.pop_back();
+      return false;
    }
 
    void startCounters() {
+      if (lazy)
+         acquireSharedCounters();
+      if (usesPrctl()) {
+         startAll({this});
+         return;
+      }
+      for (auto& extension : extensions)
+         extension->start(*this);
+      if (shared) {
+         // other instances may be running on the same fds, so never reset them
+         {
+            std::lock_guard<std::mutex> guard(shared->mutex);
+            if (shared->active++ == 0)
+               for (auto& event : events)
+                  event.control(PERF_EVENT_IOC_ENABLE);
+            sharedRunning = true;
+         }
+         for (unsigned i=0; i<events.size(); i++)
+            if (!events[i].readInto(events[i].prev, &events[i].partsPrev))
+               std::cerr << "Error reading counter " << names[i] << std::endl;
+         startTime = std::chrono::steady_clock::now();
+         return;
+      }
       for (unsigned i=0; i<events.size(); i++) {
          auto& event = events[i];
-         ioctl(event.fd, PERF_EVENT_IOC_RESET, 0);
-         ioctl(event.fd, PERF_EVENT_IOC_ENABLE, 0);
-         if (read(event.fd, &event.prev, sizeof(uint64_t) * 3) != sizeof(uint64_t) * 3)
+         event.control(PERF_EVENT_IOC_RESET);
+         event.control(PERF_EVENT_IOC_ENABLE);
+         if (!event.readInto(event.prev, &event.partsPrev))
             std::cerr << "Error reading counter " << names[i] << std::endl;
       }
       startTime = std::chrono::steady_clock::now();
    }
 
    ~PerfEvent() {
-      for (auto& event : events) {
-         close(event.fd);
-      }
+      closeCounters();
+      if (cgroupFd >= 0)
+         close(cgroupFd);
    }
 
    void stopCounters() {
+      if (usesPrctl()) {
+         stopAll({this});
+         return;
+      }
+      stopTime = std::chrono::steady_clock::now();
+      for (unsigned i=0; i<events.size(); i++) {
+         auto& event = events[i];
+         if (!event.readInto(event.data, &event.partsData))
+            std::cerr << "Error reading counter " << names[i] << std::endl;
+         if (!shared)
+            event.control(PERF_EVENT_IOC_DISABLE);
+      }
+      if (shared) {
+         std::lock_guard<std::mutex> guard(shared->mutex);
+         if (sharedRunning && shared->active && --shared->active == 0)
+            for (auto& event : events)
+               event.control(PERF_EVENT_IOC_DISABLE);
+         sharedRunning = false;
+      }
+      for (auto& extension : extensions)
+         extension->stop(*this);
+   }
+
+   bool usesPrctl() const {
+      return processWideToggle && owner == static_cast<pid_t>(syscall(SYS_gettid));
+   }
+
+   // Starts several PerfEvents opened by the calling thread with one prctl. The counters are
+   // disabled at this point, so reading the start values does not need to be synchronized.
+   static void startAll(const std::vector<PerfEvent*>& perfs) {
+      for (auto* perf : perfs) {
+         for (auto& extension : perf->extensions)
+            extension->start(*perf);
+         for (unsigned i=0; i<perf->events.size(); i++) {
+            if (!perf->events[i].readInto(perf->events[i].prev, &perf->events[i].partsPrev))
+               std::cerr << "Error reading counter " << perf->names[i] << std::endl;
+         }
+      }
+      auto now = std::chrono::steady_clock::now();
+      prctl(PR_TASK_PERF_EVENTS_ENABLE);
+      for (auto* perf : perfs)
+         perf->startTime = now;
+   }
+
+   static void stopAll(const std::vector<PerfEvent*>& perfs) {
+      prctl(PR_TASK_PERF_EVENTS_DISABLE);
+      auto now = std::chrono::steady_clock::now();
+      for (auto* perf : perfs) {
+         perf->stopTime = now;
+         for (unsigned i=0; i<perf->events.size(); i++) {
+            if (!perf->events[i].readInto(perf->events[i].data, &perf->events[i].partsData))
+               std::cerr << "Error reading counter " << perf->names[i] << std::endl;
+         }
+         for (auto& extension : perf->extensions)
+            extension->stop(*perf);
+      }
+   }
+
+   // Runs argv as a child process and counts exactly its lifetime from exec to exit (including its
+   // own children), without any events of the calling process. The counters of this PerfEvent are
+   // not touched, only their configuration is reused, so this can be called repeatedly. Afterwards
+   // printReport and the getters report the child run. Returns the waitpid status, or -1 on error,
+   // including a failed exec (errno is then set to its error and the counters are left unchanged).
+   int runAndMeasure(char* const argv[]) {
+      int go[2];
+      if (pipe2(go, O_CLOEXEC) < 0)
+         return -1;
+      // carries the errno of a failed exec, a successful exec closes it
+      int execError[2];
+      if (pipe2(execError, O_CLOEXEC) < 0) {
+         close(go[0]);
+         close(go[1]);
+         return -1;
+      }
+      pid_t child = fork();
+      if (child < 0) {
+         close(go[0]);
+         close(go[1]);
+         close(execError[0]);
+         close(execError[1]);
+         return -1;
+      }
+      if (child == 0) {
+         // block until the parent has attached the counters
+         char c;
+         close(go[1]);
+         close(execError[0]);
+         if (read(go[0], &c, 1) != 1)
+            _exit(127);
+         execvp(argv[0], argv);
+         int error = errno;
+         if (write(execError[1], &error, sizeof(error)) != sizeof(error)) {}
+         _exit(127);
+      }
+      close(go[0]);
+      close(execError[1]);
+
+      // opened through openCounter with the child as the only target
+      std::vector<Target> ownTargets = {{child, -1, 0}};
+      std::swap(targets, ownTargets);
+      std::vector<std::vector<int>> childFds(events.size());
+      std::vector<std::vector<event::FdOrigin>> childOrigins(events.size());
+      for (unsigned i=0; i<events.size(); i++) {
+         event childEvent = events[i];
+         childEvent.pe.disabled = true;
+         childEvent.pe.enable_on_exec = true;
+         childEvent.pe.inherit = 1;
+         if (!openCounter(childEvent, 0, childFds[i], childOrigins[i])) {
+            std::cerr << "Error opening counter " << names[i] << std::endl;
+            std::swap(targets, ownTargets);
+            for (auto& fds : childFds)
+               for (int f : fds)
+                  backend->closeEvent(f);
+            kill(child, SIGKILL);
+            close(go[1]);
+            close(execError[0]);
+            waitpid(child, nullptr, 0);
+            return -1;
+         }
+      }
+      std::swap(targets, ownTargets);
+
+      int status = -1;
+      startTime = std::chrono::steady_clock::now();
+      if (write(go[1], "x", 1) != 1)
+         kill(child, SIGKILL);
+      close(go[1]);
+      while (waitpid(child, &status, 0) < 0 && errno == EINTR) {}
       stopTime = std::chrono::steady_clock::now();
+
+      int error = 0;
+      bool execFailed = read(execError[0], &error, sizeof(error)) == sizeof(error);
+      close(execError[0]);
+      if (execFailed) {
+         // the counters never started, so there is nothing to report
+         std::cerr << "Error executing " << argv[0] << ": " << strerror(error) << std::endl;
+         for (auto& fds : childFds)
+            for (int fd : fds)
+               backend->closeEvent(fd);
+         errno = error;
+         return -1;
+      }
+
       for (unsigned i=0; i<events.size(); i++) {
          auto& event = events[i];
-         if (read(event.fd, &event.data, sizeof(uint64_t) * 3) != sizeof(uint64_t) * 3)
+         event.prev = event::read_format();
+         event.partsPrev.assign(event.parts.size(), event::read_format());
+         std::swap(event.fds, childFds[i]);
+         std::swap(event.origins, childOrigins[i]);
+         if (!event.readInto(event.data, &event.partsData))
             std::cerr << "Error reading counter " << names[i] << std::endl;
-         ioctl(event.fd, PERF_EVENT_IOC_DISABLE, 0);
+         std::swap(event.fds, childFds[i]);
+         std::swap(event.origins, childOrigins[i]);
+         for (int fd : childFds[i])
+            backend->closeEvent(fd);
       }
+      return status;
    }
 
    double getDuration() {
@@ -160,6 +931,17 @@ struct PerfEvent {
      return event ? event->readCounter() : -1;
    }
 
+   // raw (not multiplexing-corrected) value of a counter per core PMU on hybrid CPUs, empty otherwise
+   std::vector<std::pair<std::string, double>> getCounterPerPmu(const std::string& name) {
+      std::vector<std::pair<std::string, double>> result;
+      auto event = getEvent(name);
+      if (!event || event->partsData.size() != event->parts.size() || event->partsPrev.size() != event->parts.size())
+         return result;
+      for (unsigned p=0; p<event->parts.size(); p++)
+         result.emplace_back(event->parts[p].name, static_cast<double>(event->partsData[p].value - event->partsPrev[p].value));
+      return result;
+   }
+
    event* getEvent(const std::string& name) {
      for (unsigned i = 0; i < events.size(); i++)
          if (names[i] == name) return &events[i];
@@ -194,8 +976,14 @@ struct PerfEvent {
       // print all metrics
       for (unsigned i=0; i<events.size(); i++) {
          printCounter(headerOut,dataOut,names[i],events[i].readCounter()/static_cast<double>(normalizationConstant));
+         if (reportPerPmu)
+            for (auto& part : getCounterPerPmu(names[i]))
+               printCounter(headerOut,dataOut,names[i]+"["+part.first+"]",part.second/static_cast<double>(normalizationConstant));
       }
 
+      for (auto& extension : extensions)
+         extension->report(*this,headerOut,dataOut,normalizationConstant);
+
       printCounter(headerOut,dataOut,"scale",normalizationConstant);
 
       // derived metrics
@@ -243,6 +1031,7 @@ struct PerfRef {
     bool has_instance;
 
     PerfRef() : instance(), has_instance(true) {}
+    PerfRef(PerfEvent::Shared shared) : instance(shared), has_instance(true) {}
     PerfRef(PerfEvent *ptr) : pointer(ptr), has_instance(false) {}
     PerfRef(const PerfRef&) = delete;
 
@@ -270,6 +1059,15 @@ struct PerfEventBlock {
      e->startCounters();
    }
 
+   // a block on the shared per-thread context, see PerfEvent(Shared)
+   PerfEventBlock(PerfEvent::Shared shared, uint64_t scale = 1, BenchmarkParameters params = {}, bool printHeader = true)
+       : e(shared),
+         scale(scale),
+         parameters(params),
+         printHeader(printHeader) {
+     e->startCounters();
+   }
+
    PerfEventBlock(PerfEvent& perf, uint64_t scale = 1, BenchmarkParameters params = {}, bool printHeader = true)
        : e(&perf),
          scale(scale),
@@ -294,9 +1092,17 @@ struct PerfEventBlock {
 
 #else
 #include <ostream>
+#include <string>
 struct PerfEvent {
+   PerfEvent() {}
+   explicit PerfEvent(int, bool = true) {}
+   struct Cgroup { std::string path; };
+   explicit PerfEvent(const Cgroup&) {}
+   struct Shared {};
+   explicit PerfEvent(Shared) {}
    void startCounters() {}
    void stopCounters() {}
+   int runAndMeasure(char* const[]) { return -1; }
    void printReport(std::ostream&, uint64_t) {}
    template <class T> void setParam(const std::string&, const T&) {};
 };
@@ -307,5 +1113,6 @@ struct BenchmarkParameters {
 struct PerfEventBlock {
    PerfEventBlock(uint64_t = 1, BenchmarkParameters = {}, bool = true) {};
    PerfEventBlock(PerfEvent e, uint64_t = 1, BenchmarkParameters = {}, bool = true) {};
+   PerfEventBlock(PerfEvent::Shared, uint64_t = 1, BenchmarkParameters = {}, bool = true) {};
 };
 #endif
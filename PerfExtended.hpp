@@ -1,6 +1,13 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <cmath>
+#include <limits>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <sstream>
 #include <vector>
 #include <thread>
 #include <chrono>
@@ -10,15 +17,294 @@
 #include <tbb/enumerable_thread_specific.h>
 
 #include "PerfEvent.hpp"
+#include "PerfTrace.hpp"
 
 struct BackgroundTracker;
 BackgroundTracker* GLOBAL_TRACKER = nullptr;
 
 #ifndef PERF_NO_BACKGROUND_TRACKING
+/**
+ * Online change-point detection over the cumulative counter samples of the BackgroundTracker.
+ * Each sampling interval yields one feature per counter (its rate per µs) plus the IPC if cycles and
+ * instructions are both sampled. A new phase starts when, for any feature, each of the last `window`
+ * intervals differs from the mean of the current phase by more than `threshold` (relative), all in the
+ * same direction. The phase boundary is placed before the first of these intervals.
+ * */
+struct PhaseDetector {
+    using clock_t = std::chrono::steady_clock;
+    using counter_t = uint64_t;
+    struct Sample {
+        clock_t::time_point time;
+        std::vector<counter_t> values;
+    };
+    struct Phase {
+        Sample begin;
+        Sample end;
+    };
+
+    unsigned window;
+    double threshold;
+    int cycles_index = -1;
+    int instructions_index = -1;
+    std::vector<Phase> phases;  // closed phases, the current one is added by finish()
+
+    PhaseDetector(unsigned window = 10, double threshold = 0.3) : window(std::max(1u, window)), threshold(threshold) {}
+
+    // names of the sampled counters, in the order of the observed values; enables the IPC feature
+    void configure(const std::vector<std::string>& sampled) {
+        auto index = [&](const char* name) {
+            auto it = std::find(sampled.begin(), sampled.end(), name);
+            return it == sampled.end() ? -1 : static_cast<int>(it - sampled.begin());
+        };
+        cycles_index = index("cycles");
+        instructions_index = index("instructions");
+    }
+
+    void observe(clock_t::time_point time, const std::vector<counter_t>& values) {
+        if (!started) {
+            started = true;
+            phase_begin = last = {time, values};
+            return;
+        }
+        recent.push_back({time, values, features(last, time, values)});
+        last = {time, values};
+        if (recent.size() > window) {
+            auto& oldest = recent.front();
+            if (phase_sum.empty()) { phase_sum.assign(oldest.features.size(), 0); }
+            for (size_t k = 0; k != phase_sum.size(); ++k) { phase_sum[k] += oldest.features[k]; }
+            ++phase_samples;
+            phase_last = {oldest.time, oldest.values};
+            recent.pop_front();
+        }
+        if (phase_samples >= window && recent.size() == window && changed()) {
+            phases.push_back({phase_begin, phase_last});
+            phase_begin = phase_last;
+            phase_sum.assign(phase_sum.size(), 0);
+            for (auto& interval : recent) {
+                for (size_t k = 0; k != phase_sum.size(); ++k) { phase_sum[k] += interval.features[k]; }
+            }
+            phase_samples = recent.size();
+            phase_last = {recent.back().time, recent.back().values};
+            recent.clear();
+        }
+    }
+
+    // closes the running phase at the last observed sample
+    void finish() {
+        if (started && last.time != phase_begin.time) { phases.push_back({phase_begin, last}); }
+        started = false;
+    }
+
+private:
+    struct Interval {
+        clock_t::time_point time;
+        std::vector<counter_t> values;
+        std::vector<double> features;
+    };
+
+    bool started = false;
+    Sample phase_begin;
+    Sample phase_last;
+    Sample last;
+    std::deque<Interval> recent;
+    std::vector<double> phase_sum;
+    size_t phase_samples = 0;
+
+    std::vector<double> features(const Sample& prev, clock_t::time_point time, const std::vector<counter_t>& values) const {
+        double us = std::max(1.0, std::chrono::duration<double, std::micro>(time - prev.time).count());
+        std::vector<double> result;
+        for (size_t i = 0; i != values.size(); ++i) {
+            result.push_back(static_cast<double>(values[i] - prev.values[i]) / us);
+        }
+        if (cycles_index >= 0 && instructions_index >= 0) {
+            double cycles = static_cast<double>(values[cycles_index] - prev.values[cycles_index]);
+            double instructions = static_cast<double>(values[instructions_index] - prev.values[instructions_index]);
+            result.push_back(cycles > 0 ? instructions / cycles : 0);
+        }
+        return result;
+    }
+
+    bool changed() const {
+        for (size_t k = 0; k != phase_sum.size(); ++k) {
+            double phase_mean = phase_sum[k] / static_cast<double>(phase_samples);
+            bool above = true, below = true;
+            for (auto& interval : recent) {
+                double x = interval.features[k];
+                double scale = std::max(std::abs(phase_mean), std::abs(x));
+                bool deviates = scale > 1e-9 && std::abs(x - phase_mean) > threshold * scale;
+                above &= deviates && x > phase_mean;
+                below &= deviates && x < phase_mean;
+            }
+            if (above || below) { return true; }
+        }
+        return false;
+    }
+};
+
+/**
+ * Per-interval deltas and rates of the sampled counters, aggregated into buckets of `bucket_us`
+ * (0 keeps one row per sampling interval). Every metric is the ratio of two per-interval deltas,
+ * e.g. LLC-misses per µs, instructions per cycle, or task-clock per wall-clock time (CPUs). A bucket
+ * reports the average over its whole duration and the min/max of the individual intervals.
+ * */
+struct IntervalMetrics {
+    using clock_t = std::chrono::steady_clock;
+    using counter_t = uint64_t;
+    static constexpr int wall_us = -1;
+
+    struct Metric {
+        std::string name;
+        int numerator;    // index of the counter, or wall_us
+        int denominator;  // index of the counter, or wall_us
+        double factor;
+    };
+    struct Bucket {
+        clock_t::time_point begin;
+        clock_t::time_point end;
+        unsigned intervals = 0;
+        std::vector<counter_t> delta;  // per counter
+        std::vector<double> min;       // per metric
+        std::vector<double> max;       // per metric
+    };
+
+    unsigned bucket_us;
+    std::vector<std::string> counters;
+    std::vector<Metric> metrics;
+    std::vector<Bucket> buckets;
+
+    explicit IntervalMetrics(unsigned bucket_us = 0) : bucket_us(bucket_us) {}
+
+    void configure(const std::vector<std::string>& sampled) {
+        counters = sampled;
+        metrics.clear();
+        auto index = [&](const char* name) {
+            auto it = std::find(counters.begin(), counters.end(), name);
+            return it == counters.end() ? -2 : static_cast<int>(it - counters.begin());
+        };
+        for (auto i = 0u; i != counters.size(); ++i) {
+            if (counters[i] != "task-clock") { metrics.push_back({counters[i] + "/us", static_cast<int>(i), wall_us, 1}); }
+        }
+        if (index("instructions") >= 0 && index("cycles") >= 0) {
+            metrics.push_back({"IPC", index("instructions"), index("cycles"), 1});
+        }
+        if (index("cycles") >= 0 && index("task-clock") >= 0) {
+            metrics.push_back({"GHz", index("cycles"), index("task-clock"), 1});
+        }
+        if (index("task-clock") >= 0) { metrics.push_back({"CPUs", index("task-clock"), wall_us, 1e-3}); }
+    }
+
+    void observe(clock_t::time_point time, const std::vector<counter_t>& values) {
+        if (!started) {
+            started = true;
+            last_time = time;
+            last = values;
+            return;
+        }
+        double us = std::chrono::duration<double, std::micro>(time - last_time).count();
+        if (buckets.empty() || (bucket_us && time - buckets.back().begin > std::chrono::microseconds(bucket_us)) ||
+            (!bucket_us && buckets.back().intervals)) {
+            Bucket bucket;
+            bucket.begin = last_time;
+            bucket.delta.assign(values.size(), 0);
+            bucket.min.assign(metrics.size(), std::numeric_limits<double>::infinity());
+            bucket.max.assign(metrics.size(), -std::numeric_limits<double>::infinity());
+            buckets.push_back(std::move(bucket));
+        }
+        auto& bucket = buckets.back();
+        bucket.end = time;
+        ++bucket.intervals;
+        for (auto i = 0u; i != values.size(); ++i) { bucket.delta[i] += values[i] - last[i]; }
+        for (auto m = 0u; m != metrics.size(); ++m) {
+            double value = ratio(metrics[m], us, values);
+            if (!std::isfinite(value)) { continue; }
+            bucket.min[m] = std::min(bucket.min[m], value);
+            bucket.max[m] = std::max(bucket.max[m], value);
+        }
+        last_time = time;
+        last = values;
+    }
+
+    using Markers = std::function<std::string(clock_t::time_point, clock_t::time_point)>;
+
+    // `markers` names the application markers within a bucket
+    void write_csv(std::ostream& output, bool print_header, const Markers& markers) {
+        write_rows(output, print_header, markers, buckets.size());
+    }
+
+    // writes and drops all completed buckets, so a long run keeps only the open one in memory
+    void flush_csv(std::ostream& output, bool print_header, const Markers& markers) {
+        size_t completed = buckets.empty() ? 0 : buckets.size() - 1;
+        write_rows(output, print_header, markers, completed);
+        buckets.erase(buckets.begin(), buckets.begin() + static_cast<std::ptrdiff_t>(completed));
+    }
+
+private:
+    bool started = false;
+    size_t written = 0;  // rows written so far, the header precedes the first
+    clock_t::time_point last_time;
+    std::vector<counter_t> last;
+
+    void write_rows(std::ostream& output, bool print_header, const Markers& markers, size_t count) {
+        for (auto b = 0u; b != count; ++b) {
+            auto& bucket = buckets[b];
+            double us = std::chrono::duration<double, std::micro>(bucket.end - bucket.begin).count();
+            std::stringstream header;
+            std::stringstream data;
+            PerfEvent::printCounter(header, data, "begin_us",
+                                    std::chrono::duration_cast<std::chrono::microseconds>(bucket.begin.time_since_epoch()).count());
+            PerfEvent::printCounter(header, data, "duration_us", us);
+            if (bucket_us) { PerfEvent::printCounter(header, data, "intervals", bucket.intervals); }
+            for (auto i = 0u; i != counters.size(); ++i) {
+                PerfEvent::printCounter(header, data, counters[i], bucket.delta[i]);
+            }
+            for (auto m = 0u; m != metrics.size(); ++m) {
+                PerfEvent::printCounter(header, data, metrics[m].name, average(metrics[m], us, bucket.delta));
+                if (bucket_us) {
+                    PerfEvent::printCounter(header, data, metrics[m].name + " min", bucket.min[m]);
+                    PerfEvent::printCounter(header, data, metrics[m].name + " max", bucket.max[m]);
+                }
+            }
+            PerfEvent::printCounter(header, data, "markers", markers(bucket.begin, bucket.end), false);
+            if (written++ == 0 && print_header) { output << header.str() << std::endl; }
+            output << data.str() << std::endl;
+        }
+    }
+
+    double ratio(const Metric& metric, double us, const std::vector<counter_t>& values) const {
+        auto delta = [&](int index) {
+            return index == wall_us ? us : static_cast<double>(values[index] - last[index]);
+        };
+        return delta(metric.numerator) / delta(metric.denominator) * metric.factor;
+    }
+
+    static double average(const Metric& metric, double us, const std::vector<counter_t>& delta) {
+        auto total = [&](int index) { return index == wall_us ? us : static_cast<double>(delta[index]); };
+        return total(metric.numerator) / total(metric.denominator) * metric.factor;
+    }
+};
+
+struct TrackerOptions {
+    // sampled by the tracker thread; adding cycles and instructions gives the IPC of phases and intervals
+    std::vector<std::string> counters = {"LLC-misses"};
+    bool raw_counters = true;                            // keep every sample in the event records
+    bool track_intervals = false;                        // per-interval deltas and rates, one CSV row per bucket
+    IntervalMetrics intervals;                           // bucket_us = 0: one row per sampling interval
+    bool detect_phases = false;                          // segment the run with `phases`, one CSV row per phase
+    PhaseDetector phases;
+    std::string stream_path;                             // if set, records are streamed into this PerfTraceFile
+    size_t chunk_records = 1 << 16;                      // records per thread buffered before streaming a chunk
+
+    TrackerOptions() = default;
+    // only phase detection, so BackgroundTracker(..., output, PhaseDetector(window, threshold)) keeps working
+    TrackerOptions(PhaseDetector phases) : detect_phases(true), phases(std::move(phases)) {}
+};
+
 struct BackgroundTracker {
     using event = PerfEvent::event;
     using clock_t = std::chrono::steady_clock;
     using counter_t = uint64_t;
+    using Kind = PerfTraceFile::Record::Kind;
+    // `type` is a name id, tagged with a Kind for markers and spans (see PerfTraceFile::Record)
     struct Record {
         unsigned type;
         clock_t::time_point time;
@@ -26,25 +312,48 @@ struct BackgroundTracker {
     };
     PerfEventBlock perf;
     std::vector<std::string>& names;
+    mutable std::mutex names_mutex; // guards names, which intern() appends to from any thread
+    std::vector<Record> marker_log; // markers and spans of flushed chunks, for interval and phase output
+    std::mutex marker_mutex;
+    unsigned first_tracked_id;
+    bool raw_counters;
+    std::unique_ptr<PerfTraceFile> trace;
+    size_t chunk_records;
     std::vector<event*> tracked_events;
     tbb::enumerable_thread_specific<std::vector<Record>> thread_events;
     std::atomic<int> barrier{0};
     std::ostream& output;
+    bool track_intervals;
+    IntervalMetrics intervals;
+    bool detect_phases;
+    PhaseDetector phases;
     std::thread tracker;
 
     BackgroundTracker(std::vector<std::string>& names, uint64_t scale = 1,
                       BenchmarkParameters params = {}, bool printHeader = true,
-                      unsigned freq_us = 100, std::ostream& output = std::cerr)
+                      unsigned freq_us = 100, std::ostream& output = std::cerr,
+                      TrackerOptions options = TrackerOptions())
         : perf(scale, params, printHeader)
-        , names(initialize_names(names))
-        , tracked_events(initialize_tracked_events(perf.e))
+        , names(names)
+        , first_tracked_id(static_cast<unsigned>(names.size()))
+        , raw_counters(options.raw_counters)
+        , trace(options.stream_path.empty() ? nullptr : std::make_unique<PerfTraceFile>(options.stream_path))
+        , chunk_records(std::max<size_t>(1, options.chunk_records))
+        , tracked_events(initialize_tracked_events(perf.e, names, options.counters))
         , thread_events([&, scale]() {
             std::vector<Record> res;
-            res.reserve(scale / std::thread::hardware_concurrency());
+            res.reserve(trace ? chunk_records : scale / std::thread::hardware_concurrency());
             return res;
         })
         , output(output)
-        , tracker(tracker_task, std::ref(*this), freq_us) {
+        , track_intervals(options.track_intervals)
+        , intervals(std::move(options.intervals))
+        , detect_phases(options.detect_phases)
+        , phases(std::move(options.phases))
+        , tracker() {
+        intervals.configure(options.counters);
+        phases.configure(options.counters);
+        tracker = std::thread(tracker_task, std::ref(*this), freq_us);
         if (GLOBAL_TRACKER) { throw std::logic_error("BackgroundTracker already exists"); }
         GLOBAL_TRACKER = this;
         barrier.store(1);
@@ -55,76 +364,231 @@ struct BackgroundTracker {
         tracker.join();
         perf.e->stopCounters();
         perf.stopped = true;
-        write_events_csv();
+        if (trace) {
+            for (auto& list : thread_events) { flush(list); }
+        } else {
+            for (auto& list : thread_events) { log_markers(list); }
+            write_events_csv();
+        }
+        std::sort(marker_log.begin(), marker_log.end(), [](auto& a, auto& b) { return a.time < b.time; });
+        if (track_intervals) {
+            intervals.write_csv(output, perf.printHeader,
+                                [this](clock_t::time_point b, clock_t::time_point e) { return markers_between(b, e); });
+        }
+        if (detect_phases) { write_phases_csv(); }
         GLOBAL_TRACKER = nullptr;
     }
 
     static void tracker_task(BackgroundTracker& tracker, unsigned freq_us) {
         while (!tracker.barrier) { usleep(freq_us); }
         auto& list = tracker.thread_events.local();
-        auto tracked_id = tracker.names.size() - 1;
 
+        std::vector<counter_t> values(tracker.tracked_events.size());
         while (tracker.barrier.load() == 1) {
-            auto event_id = tracked_id;
-            for (auto& event : tracker.tracked_events) {
-                if (read(event->fd, &event->data, sizeof(uint64_t) * 3) != sizeof(uint64_t) * 3)
-                    std::cerr << "Error reading counter " << tracker.names[event_id] << std::endl;
-                list.emplace_back(event_id, clock_t::now(), event->readCounterCheap());
-                --event_id;
+            auto now = clock_t::now();
+            for (auto i = 0u; i != tracker.tracked_events.size(); ++i) {
+                auto& event = tracker.tracked_events[i];
+                values[i] = 0;
+                if (!event) { continue; }
+                if (!event->readInto(event->data))
+                    std::cerr << "Error reading counter " << tracker.names[tracker.first_tracked_id + i] << std::endl;
+                values[i] = event->readCounterCheap();
+                if (tracker.raw_counters) { tracker.append(list, tracker.first_tracked_id + i, now, values[i]); }
+            }
+            if (tracker.track_intervals) {
+                tracker.intervals.observe(now, values);
+                if (tracker.trace && tracker.intervals.buckets.size() > streamed_buckets) { tracker.stream_intervals(); }
             }
+            if (tracker.detect_phases) { tracker.phases.observe(now, values); }
             usleep(freq_us);
         }
+        if (tracker.detect_phases) { tracker.phases.finish(); }
     }
 
+    // interval rows kept in memory in stream mode before they are written to `output`
+    static constexpr size_t streamed_buckets = 1024;
+
     inline void push_event(unsigned event_id, counter_t value) {
-        auto& list = thread_events.local();
-        list.emplace_back(event_id, clock_t::now(), value);
+        append(thread_events.local(), event_id, clock_t::now(), value);
     }
 
     inline void push_event(std::vector<Record>& list, unsigned event_id, counter_t value) {
-        list.emplace_back(event_id, clock_t::now(), value);
+        append(list, event_id, clock_t::now(), value);
     }
 
+    // records for names that were never registered are dropped
     inline void push_event(const std::string& event_name, counter_t value) {
-        auto& list = thread_events.local();
-        list.emplace_back(id_for_name(event_name), clock_t::now(), value);
+        auto id = id_for_name(event_name);
+        if (known(id, event_name)) { append(thread_events.local(), id, clock_t::now(), value); }
     }
 
     inline void push_event(std::vector<Record>& list, const std::string& event_name, counter_t value) {
-        list.emplace_back(id_for_name(event_name), clock_t::now(), value);
+        auto id = id_for_name(event_name);
+        if (known(id, event_name)) { append(list, id, clock_t::now(), value); }
+    }
+
+    // Returns the id of a string label for markers and spans. Intern labels once outside of hot
+    // loops, pushing a marker then only stores the id.
+    unsigned intern(const std::string& label) {
+        std::lock_guard<std::mutex> guard(names_mutex);
+        auto id = find_name(label);
+        if (id != unknown_name) { return id; }
+        names.push_back(label);
+        return static_cast<unsigned>(names.size() - 1);
+    }
+
+    // point-in-time marker, e.g. "batch 17 start", with an optional payload
+    inline void mark(unsigned label_id, counter_t value = 0) {
+        if (label_id == unknown_name) { return; }
+        append(thread_events.local(), tagged(Kind::MARK, label_id), clock_t::now(), value);
+    }
+
+    inline void begin_span(unsigned label_id, counter_t value = 0) {
+        if (label_id == unknown_name) { return; }
+        append(thread_events.local(), tagged(Kind::SPAN_BEGIN, label_id), clock_t::now(), value);
     }
 
+    inline void end_span(unsigned label_id, counter_t value = 0) {
+        if (label_id == unknown_name) { return; }
+        append(thread_events.local(), tagged(Kind::SPAN_END, label_id), clock_t::now(), value);
+    }
+
+    // begin_span/end_span for the lifetime of a scope
+    struct Span {
+        BackgroundTracker& tracker;
+        unsigned label_id;
+        Span(BackgroundTracker& tracker, unsigned label_id) : tracker(tracker), label_id(label_id) {
+            tracker.begin_span(label_id);
+        }
+        ~Span() { tracker.end_span(label_id); }
+    };
+
+    static constexpr unsigned unknown_name = static_cast<unsigned>(-1);
+
+    // unknown_name if ev_name was never registered or interned
     inline unsigned id_for_name(const std::string& ev_name) const {
+        std::lock_guard<std::mutex> guard(names_mutex);
+        return find_name(ev_name);
+    }
+
+private:
+    std::atomic<bool> reported_unknown{false};
+
+    inline unsigned find_name(const std::string& ev_name) const {
         for (auto i = 0u; i != names.size(); ++i) {
             if (names[i] == ev_name) { return i; }
         }
-        return -1;
+        return unknown_name;
     }
 
-private:
-    static std::vector<std::string>& initialize_names(std::vector<std::string>& names) {
-        names.push_back("LLC-misses");
-        return names;
+    // reports the first unknown name, later ones are dropped silently
+    bool known(unsigned id, const std::string& ev_name) {
+        if (id != unknown_name) { return true; }
+        if (!reported_unknown.exchange(true)) { std::cerr << "Dropping records of unknown name " << ev_name << std::endl; }
+        return false;
+    }
+
+    inline void append(std::vector<Record>& list, unsigned event_id, clock_t::time_point time, counter_t value) {
+        list.emplace_back(event_id, time, value);
+        if (trace && list.size() >= chunk_records) { flush(list); }
     }
 
-    static std::vector<event*> initialize_tracked_events(PerfRef& perf) {
-        return std::vector<event*>({perf->getEvent("LLC-misses")});
+    static constexpr unsigned tagged(Kind kind, unsigned label_id) {
+        return PerfTraceFile::Record::make_type(kind, label_id);
+    }
+
+    void log_markers(const std::vector<Record>& list) {
+        if (!track_intervals && !detect_phases) { return; }
+        std::lock_guard<std::mutex> guard(marker_mutex);
+        for (auto& record : list) {
+            if (PerfTraceFile::Record::kind_of(record.type) != Kind::VALUE) { marker_log.push_back(record); }
+        }
     }
 
-    inline static constexpr uint64_t to_us(const Record& record) {
-        return std::chrono::duration_cast<std::chrono::microseconds>(record.time.time_since_epoch())
-            .count();
+    // Writes the completed interval rows, so stream mode keeps memory bounded. Markers that a thread
+    // still buffers are not yet known and only appear in the trace, not in these rows.
+    void stream_intervals() {
+        std::lock_guard<std::mutex> guard(marker_mutex);
+        std::lock_guard<std::mutex> names_guard(names_mutex);  // labels, intern() may append
+        std::sort(marker_log.begin(), marker_log.end(), [](auto& a, auto& b) { return a.time < b.time; });
+        intervals.flush_csv(output, perf.printHeader,
+                            [this](clock_t::time_point b, clock_t::time_point e) { return markers_between(b, e); });
+    }
+
+    // labels of markers and span boundaries within [begin, end), e.g. "mark:GC|end:build"
+    std::string markers_between(clock_t::time_point begin, clock_t::time_point end) const {
+        std::string result;
+        auto it = std::lower_bound(marker_log.begin(), marker_log.end(), begin,
+                                   [](const Record& r, clock_t::time_point t) { return r.time < t; });
+        for (; it != marker_log.end() && it->time < end; ++it) {
+            if (!result.empty()) { result += '|'; }
+            result += PerfTraceFile::label(it->type, names);
+        }
+        return result.empty() ? "-" : result;
+    }
+
+    // streams the buffered records of one thread as a chunk of the trace file
+    void flush(std::vector<Record>& list) {
+        log_markers(list);
+        std::vector<PerfTraceFile::Record> chunk;
+        chunk.reserve(list.size());
+        for (auto& record : list) {
+            chunk.push_back({record.type, 0, std::chrono::duration_cast<std::chrono::nanoseconds>(record.time.time_since_epoch()).count(),
+                             record.value});
+        }
+        bool ok;
+        {
+            std::lock_guard<std::mutex> guard(names_mutex);
+            ok = trace->append(chunk.data(), chunk.size(), names);
+        }
+        if (!ok) { std::cerr << "Error streaming trace chunk" << std::endl; }
+        list.clear();
+    }
+
+    static std::vector<event*> initialize_tracked_events(PerfRef& perf, std::vector<std::string>& names,
+                                                         const std::vector<std::string>& counters) {
+        std::vector<event*> events;
+        for (auto& counter : counters) {
+            names.push_back(counter);
+            events.push_back(perf->getEvent(counter));
+            if (!events.back()) { std::cerr << "Cannot track missing counter " << counter << std::endl; }
+        }
+        return events;
+    }
+
+    inline static constexpr uint64_t to_us(const Record& record) { return to_us(record.time); }
+
+    inline static constexpr uint64_t to_us(clock_t::time_point time) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(time.time_since_epoch()).count();
     }
 
     void write_events_csv() const {
+        auto first = std::find_if(thread_events.begin(), thread_events.end(),
+                                  [](const std::vector<Record>& list) { return !list.empty(); });
+        if (first == thread_events.end()) { return; }
+
+        // as wide as the longest label that occurs, so runs without markers keep the plain name width
+        static const size_t prefix_length[] = {0, sizeof("mark:") - 1, sizeof("begin:") - 1, sizeof("end:") - 1};
+        std::vector<bool> kinds_of_name(names.size() * 4);
+        for (auto& thread_list : thread_events) {
+            for (auto& record : thread_list) {
+                auto name = PerfTraceFile::Record::name_of(record.type);
+                if (name < names.size()) { kinds_of_name[name * 4 + PerfTraceFile::Record::kind_of(record.type)] = true; }
+            }
+        }
         auto max_name_length = 0ul;
-        for (auto& name : names) { max_name_length = std::max(max_name_length, name.length()); }
+        for (auto i = 0u; i != names.size(); ++i) {
+            max_name_length = std::max(max_name_length, names[i].length());
+            for (auto kind = 0u; kind != 4; ++kind) {
+                if (kinds_of_name[i * 4 + kind]) { max_name_length = std::max(max_name_length, names[i].length() + prefix_length[kind]); }
+            }
+        }
         max_name_length = std::max(sizeof("event, ") - 1, max_name_length);
 
-        auto time_length = std::to_string(to_us(thread_events.begin()->front())).length();
+        auto time_length = std::to_string(to_us(first->front())).length();
         time_length = std::max(sizeof("time, ") - 1, time_length);
 
-        auto value_length = std::to_string(thread_events.begin()->back().value).length();
+        auto value_length = std::to_string(first->back().value).length();
         time_length = std::max(sizeof("time, ") - 1, time_length);
 
         if (perf.printHeader) {
@@ -133,15 +597,59 @@ private:
         }
         for (auto& thread_list : thread_events) {
             for (auto& record : thread_list) {
-                output << std::setw(max_name_length) << names[record.type] << ", "
+                output << std::setw(max_name_length) << PerfTraceFile::label(record.type, names) << ", "
                        << std::setw(time_length) << to_us(record) << ", "
                        << std::setw(value_length) << record.value
                        << std::endl;
             }
         }
     }
+
+    // one row per detected phase with the counter deltas and rates within it
+    void write_phases_csv() const {
+        for (auto i = 0u; i != phases.phases.size(); ++i) {
+            auto& phase = phases.phases[i];
+            std::stringstream header;
+            std::stringstream data;
+            double us = std::chrono::duration<double, std::micro>(phase.end.time - phase.begin.time).count();
+            PerfEvent::printCounter(header, data, "phase", i);
+            PerfEvent::printCounter(header, data, "begin_us", to_us(phase.begin.time));
+            PerfEvent::printCounter(header, data, "duration_us", us);
+            auto event_id = first_tracked_id;
+            for (auto e = 0u; e != phase.begin.values.size(); ++e, ++event_id) {
+                auto delta = phase.end.values[e] - phase.begin.values[e];
+                PerfEvent::printCounter(header, data, names[event_id], delta);
+                PerfEvent::printCounter(header, data, names[event_id] + "/us", static_cast<double>(delta) / us);
+            }
+            PerfEvent::printCounter(header, data, "markers", markers_between(phase.begin.time, phase.end.time), false);
+            if (i == 0 && perf.printHeader) { output << header.str() << std::endl; }
+            output << data.str() << std::endl;
+        }
+    }
 };  // struct BackgroundTracker
 #else
+struct PhaseDetector {
+    PhaseDetector(unsigned = 10, double = 0.3) {}
+};
+
+struct IntervalMetrics {
+    explicit IntervalMetrics(unsigned = 0) {}
+};
+
+struct TrackerOptions {
+    std::vector<std::string> counters = {"LLC-misses"};
+    bool raw_counters = true;
+    bool track_intervals = false;
+    IntervalMetrics intervals;
+    bool detect_phases = false;
+    PhaseDetector phases;
+    std::string stream_path;
+    size_t chunk_records = 1 << 16;
+
+    TrackerOptions() = default;
+    TrackerOptions(PhaseDetector phases) : detect_phases(true), phases(std::move(phases)) {}
+};
+
 // NO-OP implementation with same public API
 // same behavior as PerfEventBlock
 struct BackgroundTracker {
@@ -159,7 +667,8 @@ struct BackgroundTracker {
 
     BackgroundTracker(std::vector<std::string>& names, uint64_t scale = 1,
                       BenchmarkParameters params = {}, bool printHeader = true,
-                      unsigned freq_us = 10, std::ostream& output = std::cerr)
+                      unsigned freq_us = 10, std::ostream& output = std::cerr,
+                      TrackerOptions options = TrackerOptions())
         : perf(scale, params, printHeader) {
         if (GLOBAL_TRACKER) { throw std::logic_error("BackgroundTracker already exists"); }
         GLOBAL_TRACKER = this;
@@ -172,5 +681,12 @@ struct BackgroundTracker {
     inline void push_event(const std::string& event_name, counter_t value) {}
     inline void push_event(std::vector<Record>& list, const std::string& event_name, counter_t value) {}
     inline unsigned id_for_name(const std::string& ev_name) const { return -1; }
+    unsigned intern(const std::string&) { return 0; }
+    inline void mark(unsigned, counter_t = 0) {}
+    inline void begin_span(unsigned, counter_t = 0) {}
+    inline void end_span(unsigned, counter_t = 0) {}
+    struct Span {
+        Span(BackgroundTracker&, unsigned) {}
+    };
 };  // struct BackgroundTracker
 #endif
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "PerfEvent.hpp"
+
+/**
+ * I/O columns for printReport: the deltas of /proc/<pid>/io over each region, normalized per scale
+ * unit and as MB/s, and optionally the block layer requests issued and completed. Next to cycles
+ * and LLC-misses this tells whether a region was CPU, memory or I/O bound.
+ *
+ *   PerfEvent e;
+ *   auto io = std::make_shared<PerfIo>();
+ *   io->blockTracepoints = true;                  // needs access to tracefs
+ *   e.extensions.push_back(io);
+ *   { PerfEventBlock block(e, n); scan(); }
+ *
+ * /proc/<pid>/io covers the whole process. rchar/wchar count all read/write syscall bytes including
+ * the page cache, read_bytes/write_bytes only what went to or was queued for storage.
+ * */
+struct PerfIo : PerfEvent::Extension {
+    struct Stats {
+        uint64_t rchar = 0;
+        uint64_t wchar = 0;
+        uint64_t syscr = 0;
+        uint64_t syscw = 0;
+        uint64_t read_bytes = 0;
+        uint64_t write_bytes = 0;
+        uint64_t block_issue = 0;
+        uint64_t block_complete = 0;
+    };
+
+    // Counts block:block_rq_issue/complete for the targets of the PerfEvent. Completions run in
+    // interrupt context and are only attributed to a thread they happen to interrupt, so they are
+    // exact only for CPU-wide or cgroup PerfEvents.
+    bool blockTracepoints = false;
+    Stats begin, end;
+
+    // pid 0 is the calling process
+    explicit PerfIo(pid_t pid = 0) {
+        std::string path = pid ? "/proc/" + std::to_string(pid) + "/io" : "/proc/self/io";
+        // kept open, so a region boundary costs one pread instead of open/read/close
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) { std::cerr << "Error opening " << path << std::endl; }
+    }
+
+    PerfIo(const PerfIo&) = delete;
+    PerfIo& operator=(const PerfIo&) = delete;
+
+    ~PerfIo() override {
+        for (int handle : tracepoints) { backend->closeEvent(handle); }
+        if (fd >= 0) { close(fd); }
+    }
+
+    void start(PerfEvent& e) override {
+        if (blockTracepoints && !opened) { openTracepoints(e); }
+        sample(begin);
+    }
+
+    void stop(PerfEvent&) override { sample(end); }
+
+    Stats delta() const {
+        Stats d;
+        d.rchar = end.rchar - begin.rchar;
+        d.wchar = end.wchar - begin.wchar;
+        d.syscr = end.syscr - begin.syscr;
+        d.syscw = end.syscw - begin.syscw;
+        d.read_bytes = end.read_bytes - begin.read_bytes;
+        d.write_bytes = end.write_bytes - begin.write_bytes;
+        d.block_issue = end.block_issue - begin.block_issue;
+        d.block_complete = end.block_complete - begin.block_complete;
+        return d;
+    }
+
+    void report(PerfEvent& e, std::ostream& headerOut, std::ostream& dataOut, uint64_t normalizationConstant) override {
+        if (fd < 0) { return; }
+        Stats d = delta();
+        double n = static_cast<double>(normalizationConstant);
+        double seconds = e.getDuration();
+        auto mbPerSecond = [&](uint64_t bytes) { return seconds > 0 ? bytes / seconds / 1e6 : 0.0; };
+        PerfEvent::printCounter(headerOut, dataOut, "rchar", d.rchar / n);
+        PerfEvent::printCounter(headerOut, dataOut, "wchar", d.wchar / n);
+        PerfEvent::printCounter(headerOut, dataOut, "read_bytes", d.read_bytes / n);
+        PerfEvent::printCounter(headerOut, dataOut, "write_bytes", d.write_bytes / n);
+        PerfEvent::printCounter(headerOut, dataOut, "syscr", d.syscr / n);
+        PerfEvent::printCounter(headerOut, dataOut, "syscw", d.syscw / n);
+        if (!tracepoints.empty()) {
+            PerfEvent::printCounter(headerOut, dataOut, "blk-issue", d.block_issue / n);
+            PerfEvent::printCounter(headerOut, dataOut, "blk-complete", d.block_complete / n);
+        }
+        PerfEvent::printCounter(headerOut, dataOut, "rMB/s", mbPerSecond(d.rchar));
+        PerfEvent::printCounter(headerOut, dataOut, "wMB/s", mbPerSecond(d.wchar));
+        PerfEvent::printCounter(headerOut, dataOut, "disk rMB/s", mbPerSecond(d.read_bytes));
+        PerfEvent::printCounter(headerOut, dataOut, "disk wMB/s", mbPerSecond(d.write_bytes));
+    }
+
+    // id of a tracepoint such as "block/block_rq_issue", -1 if tracefs is not accessible
+    static int64_t tracepointId(const std::string& name) {
+        for (const char* root : {"/sys/kernel/tracing/events/", "/sys/kernel/debug/tracing/events/"}) {
+            std::ifstream in(root + name + "/id");
+            int64_t id;
+            if (in >> id) { return id; }
+        }
+        return -1;
+    }
+
+    // parses the "key: value" lines of /proc/<pid>/io
+    static void parse(const char* text, Stats& out) {
+        struct Field {
+            const char* key;
+            uint64_t Stats::* member;
+        };
+        static const Field fields[] = {{"rchar", &Stats::rchar},           {"wchar", &Stats::wchar},
+                                       {"syscr", &Stats::syscr},           {"syscw", &Stats::syscw},
+                                       {"read_bytes", &Stats::read_bytes}, {"write_bytes", &Stats::write_bytes}};
+        for (const char* line = text; *line;) {
+            const char* colon = strchr(line, ':');
+            if (!colon) { break; }
+            for (auto& field : fields) {
+                size_t len = strlen(field.key);
+                if (static_cast<size_t>(colon - line) == len && !strncmp(line, field.key, len)) {
+                    out.*field.member = strtoull(colon + 1, nullptr, 10);
+                }
+            }
+            const char* next = strchr(colon, '\n');
+            if (!next) { break; }
+            line = next + 1;
+        }
+    }
+
+private:
+    int fd = -1;
+    bool opened = false;
+    std::shared_ptr<PerfBackend> backend;
+    std::vector<int> tracepoints;  // issue handles for every target, then complete handles
+
+    void sample(Stats& out) {
+        if (fd >= 0) {
+            char buf[512];
+            ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+            if (n < 0) {
+                std::cerr << "Error reading /proc io statistics" << std::endl;
+                n = 0;
+            }
+            buf[n] = 0;
+            parse(buf, out);
+        }
+        out.block_issue = out.block_complete = 0;
+        size_t half = tracepoints.size() / 2;
+        for (size_t i = 0; i < tracepoints.size(); ++i) {
+            PerfReadFormat value{};
+            if (!backend->readEvent(tracepoints[i], value)) { continue; }
+            (i < half ? out.block_issue : out.block_complete) += value.value;
+        }
+    }
+
+    // opened once for the targets of the first PerfEvent and left enabled, regions use deltas
+    void openTracepoints(PerfEvent& e) {
+        opened = true;
+        backend = e.backend;
+        for (const char* name : {"block/block_rq_issue", "block/block_rq_complete"}) {
+            int64_t id = tracepointId(name);
+            if (id < 0) {
+                std::cerr << "Error finding tracepoint " << name << ", is tracefs readable?" << std::endl;
+                closeTracepoints();
+                return;
+            }
+            perf_event_attr pe;
+            memset(&pe, 0, sizeof(pe));
+            pe.type = PERF_TYPE_TRACEPOINT;
+            pe.size = sizeof(pe);
+            pe.config = static_cast<uint64_t>(id);
+            pe.inherit = 1;
+            pe.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            if (e.cgroupFd >= 0) { PerfEvent::countPerCpu(pe); }
+            for (auto& target : e.targets) {
+                int handle = backend->openEvent(pe, target.pid, target.cpu, -1, target.flags);
+                if (handle < 0) {
+                    std::cerr << "Error opening tracepoint " << name << std::endl;
+                    closeTracepoints();
+                    return;
+                }
+                tracepoints.push_back(handle);
+            }
+        }
+    }
+
+    void closeTracepoints() {
+        for (int handle : tracepoints) { backend->closeEvent(handle); }
+        tracepoints.clear();
+    }
+};
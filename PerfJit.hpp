@@ -0,0 +1,223 @@
+#pragma once
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <string>
+
+/**
+ * Makes JIT-compiled code visible to profilers. Every registered range is
+ *  - appended to /tmp/perf-<pid>.map, which perf report/top read to name anonymous code,
+ *  - optionally written with its code bytes to a jitdump file (jit-<pid>.dump) for annotation,
+ *  - available to in-process symbolization via lookup()/symbolize().
+ *
+ *   PerfJit::enableJitdump();                      // optional, before registering code
+ *   PerfJit::registerCode("query42::join", fn, size);
+ *
+ * For jitdump, record with `perf record -k mono` (e.g. through perf-part) and run
+ * `perf inject --jit -i perf.data -o perf.jit.data` before `perf report`.
+ * */
+struct PerfJit {
+    struct Symbol {
+        std::string name;
+        uintptr_t start = 0;
+        size_t size = 0;
+    };
+
+    static void registerCode(const std::string& name, const void* addr, size_t size) {
+        auto& s = state();
+        std::lock_guard<std::mutex> guard(s.mutex);
+        auto start = reinterpret_cast<uintptr_t>(addr);
+        // a new function may reuse the memory of freed ones
+        erase_overlapping(s, start, size);
+        s.ranges[start] = Symbol{name, start, size};
+
+        if (!s.map) {
+            std::string path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+            s.map = fopen(path.c_str(), "ae");
+            if (!s.map) { std::cerr << "Error opening " << path << std::endl; }
+        }
+        if (s.map) {
+            fprintf(s.map, "%lx %zx %s\n", static_cast<unsigned long>(start), size, name.c_str());
+            fflush(s.map);
+        }
+        if (s.dump) { write_code_load(s, name, start, size); }
+    }
+
+    // removes the range from in-process lookups, perf maps are append-only and keep the last entry
+    static void unregisterCode(const void* addr) {
+        auto& s = state();
+        std::lock_guard<std::mutex> guard(s.mutex);
+        s.ranges.erase(reinterpret_cast<uintptr_t>(addr));
+    }
+
+    // Writes every subsequently registered function including its code to <dir>/jit-<pid>.dump.
+    // The file is mapped executable once so that perf record sees it and perf inject finds it.
+    static bool enableJitdump(const std::string& dir = ".") {
+        auto& s = state();
+        std::lock_guard<std::mutex> guard(s.mutex);
+        if (s.dump) { return true; }
+        std::string path = dir + "/jit-" + std::to_string(getpid()) + ".dump";
+        int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            std::cerr << "Error creating " << path << std::endl;
+            return false;
+        }
+        s.marker_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        s.marker = mmap(nullptr, s.marker_size, PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+        if (s.marker == MAP_FAILED) { s.marker = nullptr; }
+        s.dump = fdopen(fd, "wb");
+        DumpHeader header{dump_magic, 1, sizeof(DumpHeader), elf_machine(), 0,
+                          static_cast<uint32_t>(getpid()), timestamp(), 0};
+        fwrite(&header, sizeof(header), 1, s.dump);
+        fflush(s.dump);
+        return true;
+    }
+
+    static bool lookup(const void* addr, Symbol& out) {
+        auto& s = state();
+        auto a = reinterpret_cast<uintptr_t>(addr);
+        std::lock_guard<std::mutex> guard(s.mutex);
+        auto it = s.ranges.upper_bound(a);
+        if (it == s.ranges.begin()) { return false; }
+        --it;
+        if (a >= it->second.start + it->second.size) { return false; }
+        out = it->second;
+        return true;
+    }
+
+    // Name of the JIT function or shared-object symbol containing addr. Addresses without a symbol
+    // become "object+0xoffset", which stays stable across runs, or the plain address in hex.
+    static std::string symbolize(const void* addr) {
+        Symbol jit;
+        if (lookup(addr, jit)) { return jit.name; }
+        Dl_info info{};
+        char hex[2 + 2 * sizeof(uintptr_t) + 1];
+        bool found = dladdr(addr, &info);
+        if (found && info.dli_sname) {
+            int status = 0;
+            char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+            std::string name = status == 0 && demangled ? demangled : info.dli_sname;
+            free(demangled);
+            return name;
+        }
+        if (found && info.dli_fname && info.dli_fbase) {
+            const char* slash = strrchr(info.dli_fname, '/');
+            auto offset = reinterpret_cast<uintptr_t>(addr) - reinterpret_cast<uintptr_t>(info.dli_fbase);
+            snprintf(hex, sizeof(hex), "0x%lx", static_cast<unsigned long>(offset));
+            return std::string(slash ? slash + 1 : info.dli_fname) + "+" + hex;
+        }
+        snprintf(hex, sizeof(hex), "0x%lx", static_cast<unsigned long>(reinterpret_cast<uintptr_t>(addr)));
+        return hex;
+    }
+
+private:
+    static constexpr uint32_t dump_magic = 0x4A695444;  // "JiTD"
+    enum RecordId : uint32_t { JIT_CODE_LOAD = 0, JIT_CODE_CLOSE = 3 };
+
+    // layouts from tools/perf/Documentation/jitdump-specification.txt
+    struct DumpHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t total_size;
+        uint32_t elf_mach;
+        uint32_t pad1;
+        uint32_t pid;
+        uint64_t timestamp;
+        uint64_t flags;
+    };
+    struct RecordHeader {
+        uint32_t id;
+        uint32_t total_size;
+        uint64_t timestamp;
+    };
+    struct CodeLoad {
+        RecordHeader header;
+        uint32_t pid;
+        uint32_t tid;
+        uint64_t vma;
+        uint64_t code_addr;
+        uint64_t code_size;
+        uint64_t code_index;
+        // followed by the zero terminated name and the code bytes
+    };
+
+    struct State {
+        std::mutex mutex;
+        std::map<uintptr_t, Symbol> ranges;
+        FILE* map = nullptr;
+        FILE* dump = nullptr;
+        void* marker = nullptr;
+        size_t marker_size = 0;
+        uint64_t code_index = 0;
+
+        ~State() {
+            if (map) { fclose(map); }
+            if (dump) {
+                RecordHeader close{JIT_CODE_CLOSE, sizeof(RecordHeader), timestamp()};
+                fwrite(&close, sizeof(close), 1, dump);
+                fclose(dump);
+            }
+            if (marker) { munmap(marker, marker_size); }
+        }
+    };
+
+    static State& state() {
+        static State s;
+        return s;
+    }
+
+    static void erase_overlapping(State& s, uintptr_t start, size_t size) {
+        auto it = s.ranges.upper_bound(start);
+        if (it != s.ranges.begin() && std::prev(it)->second.start + std::prev(it)->second.size > start) { --it; }
+        while (it != s.ranges.end() && it->first < start + size) { it = s.ranges.erase(it); }
+    }
+
+    // perf record -k mono timestamps
+    static uint64_t timestamp() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec);
+    }
+
+    // e_machine of the running executable, as required in the jitdump header
+    static uint32_t elf_machine() {
+        unsigned char ident[20] = {};
+        FILE* exe = fopen("/proc/self/exe", "rbe");
+        if (!exe) { return 0; }
+        size_t n = fread(ident, 1, sizeof(ident), exe);
+        fclose(exe);
+        if (n != sizeof(ident)) { return 0; }
+        uint16_t machine;
+        memcpy(&machine, ident + 18, sizeof(machine));
+        return machine;
+    }
+
+    static void write_code_load(State& s, const std::string& name, uintptr_t start, size_t size) {
+        CodeLoad load;
+        load.header = {JIT_CODE_LOAD, static_cast<uint32_t>(sizeof(CodeLoad) + name.size() + 1 + size), timestamp()};
+        load.pid = static_cast<uint32_t>(getpid());
+        load.tid = static_cast<uint32_t>(syscall(SYS_gettid));
+        load.vma = start;
+        load.code_addr = start;
+        load.code_size = size;
+        load.code_index = s.code_index++;
+        fwrite(&load, sizeof(load), 1, s.dump);
+        fwrite(name.c_str(), name.size() + 1, 1, s.dump);
+        fwrite(reinterpret_cast<const void*>(start), size, 1, s.dump);
+        fflush(s.dump);
+    }
+};
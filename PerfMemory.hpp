@@ -0,0 +1,107 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "PerfEvent.hpp"
+
+/**
+ * Memory columns for printReport: page faults and dTLB misses per scale unit as additional counters,
+ * and the RSS and transparent huge page (THP) usage of the process from /proc/<pid>/smaps_rollup.
+ * Shows whether a region that was tuned for huge pages actually ran on them.
+ *
+ *   PerfEvent e;
+ *   PerfMemory::attach(e);
+ *   { PerfEventBlock block(e, n); run(); }
+ *
+ * smaps_rollup walks the page tables of the process, so a region boundary costs time proportional
+ * to the RSS, which is not counted in the region itself.
+ * */
+struct PerfMemory : PerfEvent::Extension {
+    struct Stats {
+        uint64_t rss_kb = 0;
+        uint64_t anon_huge_kb = 0;
+    };
+
+    Stats begin, end;
+
+    // pid 0 is the calling process
+    explicit PerfMemory(pid_t pid = 0) {
+        std::string path = pid ? "/proc/" + std::to_string(pid) + "/smaps_rollup" : "/proc/self/smaps_rollup";
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) { std::cerr << "Error opening " << path << std::endl; }
+    }
+
+    PerfMemory(const PerfMemory&) = delete;
+    PerfMemory& operator=(const PerfMemory&) = delete;
+
+    ~PerfMemory() override {
+        if (fd >= 0) { close(fd); }
+    }
+
+    // Adds the fault and dTLB counters to e and registers the extension. The dTLB counters are
+    // optional, e.g. many AMD CPUs do not provide store misses.
+    static std::shared_ptr<PerfMemory> attach(PerfEvent& e, pid_t pid = 0) {
+        constexpr uint64_t miss = PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+        e.addCounter("minor-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MIN);
+        e.addCounter("major-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ);
+        e.addCounter("dTLB-load-misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | miss);
+        e.addCounter("dTLB-store-misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_WRITE << 8) | miss);
+        auto memory = std::make_shared<PerfMemory>(pid);
+        e.extensions.push_back(memory);
+        return memory;
+    }
+
+    void start(PerfEvent&) override { sample(begin); }
+
+    void stop(PerfEvent&) override { sample(end); }
+
+    // percentage of the resident memory backed by anonymous huge pages at the end of the region
+    double thpPercent() const { return end.rss_kb ? 100.0 * end.anon_huge_kb / end.rss_kb : 0; }
+
+    void report(PerfEvent&, std::ostream& headerOut, std::ostream& dataOut, uint64_t) override {
+        if (fd < 0) { return; }
+        auto mb = [](uint64_t kb) { return kb / 1024.0; };
+        PerfEvent::printCounter(headerOut, dataOut, "RSS MB", mb(end.rss_kb));
+        PerfEvent::printCounter(headerOut, dataOut, "dRSS MB", mb(end.rss_kb) - mb(begin.rss_kb));
+        PerfEvent::printCounter(headerOut, dataOut, "dTHP MB", mb(end.anon_huge_kb) - mb(begin.anon_huge_kb));
+        PerfEvent::printCounter(headerOut, dataOut, "THP %", thpPercent());
+    }
+
+    // parses the "Key:   value kB" lines of smaps_rollup
+    static void parse(const char* text, Stats& out) {
+        for (const char* line = text; *line;) {
+            const char* colon = strchr(line, ':');
+            if (!colon) { break; }
+            auto is = [&](const char* key) { return static_cast<size_t>(colon - line) == strlen(key) && !strncmp(line, key, strlen(key)); };
+            if (is("Rss")) { out.rss_kb = strtoull(colon + 1, nullptr, 10); }
+            if (is("AnonHugePages")) { out.anon_huge_kb = strtoull(colon + 1, nullptr, 10); }
+            const char* next = strchr(colon, '\n');
+            if (!next) { break; }
+            line = next + 1;
+        }
+    }
+
+private:
+    int fd = -1;
+
+    void sample(Stats& out) {
+        if (fd < 0) { return; }
+        char buf[4096];
+        ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+        if (n < 0) {
+            std::cerr << "Error reading smaps_rollup" << std::endl;
+            n = 0;
+        }
+        buf[n] = 0;
+        out = Stats();
+        parse(buf, out);
+    }
+};
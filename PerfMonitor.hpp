@@ -0,0 +1,151 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "PerfEvent.hpp"
+
+/**
+ * Keeps counters running for the lifetime of a service and samples them every interval_ms.
+ * Each sample stores the counter deltas since the previous one in a fixed-size ring, from which
+ * rates over the most recent window (e.g. 1s, 10s, 60s) can be queried at any time.
+ * */
+struct PerfMonitor {
+    using clock_t = std::chrono::steady_clock;
+
+    enum Counter : unsigned { CYCLES, INSTRUCTIONS, L1_MISSES, LLC_MISSES, BRANCH_MISSES, TASK_CLOCK, COUNTERS };
+    static constexpr const char* counter_names[COUNTERS] = {"cycles",     "instructions",  "L1-misses",
+                                                            "LLC-misses", "branch-misses", "task-clock"};
+
+    struct Record {
+        clock_t::time_point end;
+        uint64_t duration_ns;
+        std::array<uint64_t, COUNTERS> delta;
+    };
+
+    struct Rates {
+        double seconds = 0;  // covered time, may be shorter than the requested window
+        double IPC = 0;
+        double GHz = 0;
+        double CPUs = 0;
+        double L1_misses_per_sec = 0;
+        double LLC_misses_per_sec = 0;
+        double branch_misses_per_sec = 0;
+    };
+
+    PerfRef perf;
+    std::array<PerfEvent::event*, COUNTERS> events{};
+    std::vector<Record> ring;
+    size_t next = 0;  // ring slot written next
+    size_t size = 0;
+    mutable std::mutex ring_mutex;
+    std::chrono::milliseconds interval;
+    bool stopping = false;
+    std::mutex stop_mutex;
+    std::condition_variable stop_signal;
+    std::thread sampler;
+
+    explicit PerfMonitor(unsigned interval_ms = 100, unsigned history_s = 60)
+        : PerfMonitor(nullptr, interval_ms, history_s) {}
+
+    explicit PerfMonitor(PerfEvent& perf, unsigned interval_ms = 100, unsigned history_s = 60)
+        : PerfMonitor(&perf, interval_ms, history_s) {}
+
+    ~PerfMonitor() {
+        {
+            std::lock_guard<std::mutex> guard(stop_mutex);
+            stopping = true;
+        }
+        stop_signal.notify_all();
+        sampler.join();
+        perf->stopCounters();
+    }
+
+    PerfMonitor(const PerfMonitor&) = delete;
+
+    // rates over the records that ended within the last `window`
+    Rates rates(std::chrono::milliseconds window) const {
+        std::array<double, COUNTERS> sum{};
+        uint64_t duration_ns = 0;
+        auto since = clock_t::now() - window;
+        {
+            std::lock_guard<std::mutex> guard(ring_mutex);
+            for (size_t i = 0; i < size; ++i) {
+                auto& record = ring[(next + ring.size() - 1 - i) % ring.size()];
+                if (record.end < since) { break; }
+                duration_ns += record.duration_ns;
+                for (unsigned c = 0; c < COUNTERS; ++c) { sum[c] += static_cast<double>(record.delta[c]); }
+            }
+        }
+        Rates rates;
+        if (!duration_ns) { return rates; }
+        rates.seconds = static_cast<double>(duration_ns) / 1e9;
+        rates.IPC = sum[INSTRUCTIONS] / sum[CYCLES];
+        rates.GHz = sum[CYCLES] / sum[TASK_CLOCK];
+        rates.CPUs = sum[TASK_CLOCK] / static_cast<double>(duration_ns);
+        rates.L1_misses_per_sec = sum[L1_MISSES] / rates.seconds;
+        rates.LLC_misses_per_sec = sum[LLC_MISSES] / rates.seconds;
+        rates.branch_misses_per_sec = sum[BRANCH_MISSES] / rates.seconds;
+        return rates;
+    }
+
+    // copy of the records within the last `window`, oldest first
+    std::vector<Record> records(std::chrono::milliseconds window) const {
+        std::vector<Record> result;
+        auto since = clock_t::now() - window;
+        std::lock_guard<std::mutex> guard(ring_mutex);
+        for (size_t i = size; i > 0; --i) {
+            auto& record = ring[(next + ring.size() - i) % ring.size()];
+            if (record.end >= since) { result.push_back(record); }
+        }
+        return result;
+    }
+
+private:
+    PerfMonitor(PerfEvent* existing, unsigned interval_ms, unsigned history_s)
+        : perf(existing ? PerfRef(existing) : PerfRef())
+        , ring(std::max(1u, history_s * 1000 / std::max(1u, interval_ms) + 1))
+        , interval(std::max(1u, interval_ms)) {
+        for (unsigned c = 0; c < COUNTERS; ++c) { events[c] = perf->getEvent(counter_names[c]); }
+        perf->startCounters();
+        sampler = std::thread(&PerfMonitor::sample_task, this);
+    }
+
+    void sample_task() {
+        std::array<PerfEvent::event::read_format, COUNTERS> prev{}, current{};
+        for (unsigned c = 0; c < COUNTERS; ++c) {
+            if (events[c]) { events[c]->readInto(prev[c]); }
+        }
+        auto prev_time = clock_t::now();
+        auto wakeup = prev_time;
+
+        std::unique_lock<std::mutex> lock(stop_mutex);
+        while (true) {
+            wakeup += interval;
+            if (stop_signal.wait_until(lock, wakeup, [this] { return stopping; })) { return; }
+
+            Record record;
+            for (unsigned c = 0; c < COUNTERS; ++c) {
+                record.delta[c] = 0;
+                if (!events[c] || !events[c]->readInto(current[c])) { continue; }
+                if (current[c].time_running != prev[c].time_running) {
+                    record.delta[c] = static_cast<uint64_t>(PerfEvent::event::delta(prev[c], current[c]));
+                }
+                prev[c] = current[c];
+            }
+            record.end = clock_t::now();
+            record.duration_ns = static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(record.end - prev_time).count());
+            prev_time = record.end;
+
+            std::lock_guard<std::mutex> guard(ring_mutex);
+            ring[next] = record;
+            next = (next + 1) % ring.size();
+            size = std::min(size + 1, ring.size());
+        }
+    }
+};
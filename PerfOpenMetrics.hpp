@@ -0,0 +1,247 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "PerfEvent.hpp"
+
+/**
+ * Renders accumulated per-region counters in the OpenMetrics text format, for Prometheus-compatible
+ * scrapers. Regions are PerfEvent extensions that add the counters of each measured region to atomic
+ * accumulators, so workers never block on a scrape.
+ *
+ *   PerfOpenMetrics metrics;
+ *   metrics.serve(9464);                          // or metrics.writeFile("/tmp/perf.prom")
+ *   PerfEvent e;
+ *   e.extensions.push_back(metrics.region("probe"));
+ *   { PerfEventBlock block(e, n); probe(); }
+ * */
+struct PerfOpenMetrics {
+    struct Region : PerfEvent::Extension {
+        static constexpr unsigned max_counters = 32;
+        struct Slot {
+            char name[64];
+            std::atomic<uint64_t> value{0};
+        };
+
+        std::string name;
+        Slot slots[max_counters];
+        std::atomic<unsigned> used{0};
+        std::mutex insert_mutex;  // only taken the first time a counter name is seen
+        std::atomic<uint64_t> duration_ns{0};
+        std::atomic<uint64_t> count{0};
+
+        explicit Region(std::string name) : name(std::move(name)) {}
+
+        void stop(PerfEvent& e) override {
+            for (unsigned i = 0; i < e.events.size(); ++i) {
+                double value = e.events[i].readCounter();
+                if (!std::isfinite(value) || value < 0) { continue; }
+                if (auto* slot = find_or_insert(e.names[i])) {
+                    slot->value.fetch_add(static_cast<uint64_t>(std::llround(value)), std::memory_order_relaxed);
+                }
+            }
+            duration_ns.fetch_add(static_cast<uint64_t>(e.getDuration() * 1e9), std::memory_order_relaxed);
+            count.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // NaN if the region never had this counter, so it is omitted instead of rendered as 0
+        double value(const std::string& counter) const {
+            unsigned n = used.load(std::memory_order_acquire);
+            for (unsigned i = 0; i < n; ++i) {
+                if (counter == slots[i].name) {
+                    return static_cast<double>(slots[i].value.load(std::memory_order_relaxed));
+                }
+            }
+            return std::numeric_limits<double>::quiet_NaN();
+        }
+
+        double getIPC() const { return value("instructions") / value("cycles"); }
+        double getGHz() const { return value("cycles") / value("task-clock"); }
+        double getCPUs() const {
+            return value("task-clock") / static_cast<double>(duration_ns.load(std::memory_order_relaxed));
+        }
+
+    private:
+        Slot* find_or_insert(const std::string& counter) {
+            unsigned n = used.load(std::memory_order_acquire);
+            for (unsigned i = 0; i < n; ++i) {
+                if (counter == slots[i].name) { return &slots[i]; }
+            }
+            std::lock_guard<std::mutex> guard(insert_mutex);
+            n = used.load(std::memory_order_relaxed);
+            for (unsigned i = 0; i < n; ++i) {
+                if (counter == slots[i].name) { return &slots[i]; }
+            }
+            if (n == max_counters) { return nullptr; }
+            snprintf(slots[n].name, sizeof(slots[n].name), "%s", counter.c_str());
+            used.store(n + 1, std::memory_order_release);
+            return &slots[n];
+        }
+    };
+
+    std::vector<std::shared_ptr<Region>> regions;
+    std::mutex regions_mutex;
+    std::atomic<bool> serving{false};
+    std::thread server;
+
+    ~PerfOpenMetrics() {
+        serving.store(false);
+        if (server.joinable()) { server.join(); }
+    }
+
+    std::shared_ptr<Region> region(const std::string& name) {
+        std::lock_guard<std::mutex> guard(regions_mutex);
+        for (auto& region : regions) {
+            if (region->name == name) { return region; }
+        }
+        regions.push_back(std::make_shared<Region>(name));
+        return regions.back();
+    }
+
+    std::string render() {
+        std::vector<std::shared_ptr<Region>> snapshot;
+        {
+            std::lock_guard<std::mutex> guard(regions_mutex);
+            snapshot = regions;
+        }
+        std::vector<std::string> counters;
+        for (auto& region : snapshot) {
+            unsigned n = region->used.load(std::memory_order_acquire);
+            for (unsigned i = 0; i < n; ++i) {
+                std::string counter = region->slots[i].name;
+                if (std::find(counters.begin(), counters.end(), counter) == counters.end()) {
+                    counters.push_back(counter);
+                }
+            }
+        }
+
+        std::ostringstream out;
+        out.precision(17);
+        auto family = [&](const std::string& metric, const char* type, const std::string& help, auto value) {
+            out << "# TYPE " << metric << " " << type << "\n# HELP " << metric << " " << help << "\n";
+            for (auto& region : snapshot) {
+                double v = value(*region);
+                if (!std::isfinite(v)) { continue; }
+                out << metric << (type[0] == 'c' ? "_total" : "") << "{region=\"" << escape(region->name) << "\"} "
+                    << v << "\n";
+            }
+        };
+        family("perfevent_regions", "counter", "Number of measured regions.",
+               [](Region& r) { return static_cast<double>(r.count.load(std::memory_order_relaxed)); });
+        family("perfevent_seconds", "counter", "Wall-clock time spent in measured regions.", [](Region& r) {
+            return static_cast<double>(r.duration_ns.load(std::memory_order_relaxed)) / 1e9;
+        });
+        for (auto& counter : counters) {
+            family("perfevent_" + sanitize(counter), "counter", "Accumulated " + counter + " counter.",
+                   [&](Region& r) { return r.value(counter); });
+        }
+        family("perfevent_ipc", "gauge", "Instructions per cycle.", [](Region& r) { return r.getIPC(); });
+        family("perfevent_ghz", "gauge", "Cycles per nanosecond of task-clock.", [](Region& r) { return r.getGHz(); });
+        family("perfevent_cpus", "gauge", "Average number of busy CPUs.", [](Region& r) { return r.getCPUs(); });
+        out << "# EOF\n";
+        return out.str();
+    }
+
+    // atomically replaces path, so readers never see a partial file
+    bool writeFile(const std::string& path) {
+        std::string tmp = path + ".tmp";
+        {
+            std::ofstream file(tmp, std::ios::trunc);
+            file << render();
+            if (!file) { return false; }
+        }
+        return rename(tmp.c_str(), path.c_str()) == 0;
+    }
+
+    // answers every HTTP request on 127.0.0.1:port with the current metrics, one listener at a time
+    bool serve(uint16_t port) {
+        if (server.joinable()) {
+            std::cerr << "Already serving metrics" << std::endl;
+            return false;
+        }
+        int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listener < 0) { return false; }
+        int one = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(listener, 16) < 0) {
+            std::cerr << "Error listening on port " << port << std::endl;
+            close(listener);
+            return false;
+        }
+        serving.store(true);
+        server = std::thread([this, listener] {
+            pollfd pfd{listener, POLLIN, 0};
+            while (serving.load()) {
+                if (poll(&pfd, 1, 100) <= 0) { continue; }
+                int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+                if (client < 0) { continue; }
+                respond(client);
+                close(client);
+            }
+            close(listener);
+        });
+        return true;
+    }
+
+private:
+    void respond(int client) {
+        // the request itself is irrelevant, read until the end of the header
+        std::string request;
+        char buffer[1024];
+        pollfd pfd{client, POLLIN, 0};
+        while (request.find("\r\n\r\n") == std::string::npos && request.size() < 16384 && poll(&pfd, 1, 1000) > 0) {
+            ssize_t n = read(client, buffer, sizeof(buffer));
+            if (n <= 0) { break; }
+            request.append(buffer, static_cast<size_t>(n));
+        }
+        std::string body = render();
+        std::string response = "HTTP/1.1 200 OK\r\n"
+                               "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                               "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                               "Connection: close\r\n\r\n" + body;
+        for (size_t written = 0; written < response.size();) {
+            ssize_t n = send(client, response.data() + written, response.size() - written, MSG_NOSIGNAL);
+            if (n <= 0) { break; }
+            written += static_cast<size_t>(n);
+        }
+    }
+
+    static std::string sanitize(const std::string& name) {
+        std::string result;
+        for (char c : name) { result += std::isalnum(static_cast<unsigned char>(c)) ? c : '_'; }
+        return result;
+    }
+
+    static std::string escape(const std::string& value) {
+        std::string result;
+        for (char c : value) {
+            if (c == '\\' || c == '"') { result += '\\'; }
+            if (c == '\n') {
+                result += "\\n";
+                continue;
+            }
+            result += c;
+        }
+        return result;
+    }
+};
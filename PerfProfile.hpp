@@ -0,0 +1,502 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "PerfJit.hpp"
+#include "PerfSampling.hpp"
+
+/**
+ * Minimal gzip (RFC 1952) writer around a single fixed-Huffman deflate block with greedy LZ77
+ * matching. Compresses protobuf profiles to roughly a third without depending on zlib.
+ * */
+struct PerfGzip {
+    static std::string compress(const std::string& input) {
+        std::string out = {'\x1f', '\x8b', 8, 0, 0, 0, 0, 0, 0, 3};  // magic, deflate, no flags/mtime, unix
+        BitWriter bits{out};
+        bits.put(1, 1);  // final block
+        bits.put(1, 2);  // fixed Huffman codes
+        deflate(reinterpret_cast<const uint8_t*>(input.data()), input.size(), bits);
+        bits.put_symbol(256);
+        bits.flush();
+        put_le32(out, crc32(input));
+        put_le32(out, static_cast<uint32_t>(input.size()));
+        return out;
+    }
+
+    static uint32_t crc32(const std::string& data) {
+        static const auto table = [] {
+            std::array<uint32_t, 256> t{};
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; ++k) { c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1; }
+                t[i] = c;
+            }
+            return t;
+        }();
+        uint32_t crc = 0xffffffffu;
+        for (unsigned char c : data) { crc = table[(crc ^ c) & 0xff] ^ (crc >> 8); }
+        return crc ^ 0xffffffffu;
+    }
+
+private:
+    struct BitWriter {
+        std::string& out;
+        uint64_t buffer = 0;
+        unsigned count = 0;
+
+        // value is written least significant bit first
+        void put(uint32_t value, unsigned bits) {
+            buffer |= static_cast<uint64_t>(value) << count;
+            count += bits;
+            while (count >= 8) {
+                out.push_back(static_cast<char>(buffer & 0xff));
+                buffer >>= 8;
+                count -= 8;
+            }
+        }
+
+        // Huffman codes are defined most significant bit first
+        void put_code(uint32_t code, unsigned bits) {
+            uint32_t reversed = 0;
+            for (unsigned i = 0; i < bits; ++i) { reversed |= ((code >> i) & 1) << (bits - 1 - i); }
+            put(reversed, bits);
+        }
+
+        // literal/length symbol of the fixed Huffman code
+        void put_symbol(unsigned symbol) {
+            if (symbol < 144) {
+                put_code(0x30 + symbol, 8);
+            } else if (symbol < 256) {
+                put_code(0x190 + symbol - 144, 9);
+            } else if (symbol < 280) {
+                put_code(symbol - 256, 7);
+            } else {
+                put_code(0xc0 + symbol - 280, 8);
+            }
+        }
+
+        void flush() {
+            if (count) { out.push_back(static_cast<char>(buffer & 0xff)); }
+            buffer = 0;
+            count = 0;
+        }
+    };
+
+    static void put_le32(std::string& out, uint32_t value) {
+        for (int i = 0; i < 4; ++i) { out.push_back(static_cast<char>((value >> (8 * i)) & 0xff)); }
+    }
+
+    static void put_match(BitWriter& bits, unsigned length, unsigned distance) {
+        static const uint16_t length_base[] = {3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+                                               31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+        static const uint8_t length_extra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                               2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+        static const uint16_t distance_base[] = {1,   2,   3,   4,   5,   7,    9,    13,   17,   25,
+                                                 33,  49,  65,  97,  129, 193,  257,  385,  513,  769,
+                                                 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+        static const uint8_t distance_extra[] = {0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+                                                 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+        unsigned l = 28;
+        while (length_base[l] > length) { --l; }
+        bits.put_symbol(257 + l);
+        bits.put(length - length_base[l], length_extra[l]);
+        unsigned d = 29;
+        while (distance_base[d] > distance) { --d; }
+        bits.put_code(d, 5);
+        bits.put(distance - distance_base[d], distance_extra[d]);
+    }
+
+    static void deflate(const uint8_t* data, size_t size, BitWriter& bits) {
+        constexpr size_t window = 32768, min_match = 3, max_match = 258, max_chain = 64;
+        constexpr unsigned hash_bits = 15;
+        std::vector<int64_t> head(1u << hash_bits, -1);
+        std::vector<int64_t> prev(window, -1);
+        auto hash = [&](size_t i) {
+            return ((data[i] << 10) ^ (data[i + 1] << 5) ^ data[i + 2]) & ((1u << hash_bits) - 1);
+        };
+        auto insert = [&](size_t i) {
+            if (i + min_match > size) { return; }
+            auto h = hash(i);
+            prev[i % window] = head[h];
+            head[h] = static_cast<int64_t>(i);
+        };
+        size_t i = 0;
+        while (i < size) {
+            size_t best_length = 0, best_distance = 0;
+            if (i + min_match <= size) {
+                int64_t candidate = head[hash(i)];
+                for (size_t chain = 0; candidate >= 0 && i - candidate <= window - 1 && chain < max_chain; ++chain) {
+                    size_t length = 0;
+                    size_t limit = std::min(max_match, size - i);
+                    while (length < limit && data[candidate + length] == data[i + length]) { ++length; }
+                    if (length > best_length) {
+                        best_length = length;
+                        best_distance = i - static_cast<size_t>(candidate);
+                        if (length == limit) { break; }
+                    }
+                    int64_t next = prev[candidate % window];
+                    if (next >= candidate) { break; }  // overwritten slot of an older position
+                    candidate = next;
+                }
+            }
+            if (best_length >= min_match) {
+                put_match(bits, static_cast<unsigned>(best_length), static_cast<unsigned>(best_distance));
+                for (size_t k = 0; k < best_length; ++k) { insert(i + k); }
+                i += best_length;
+            } else {
+                bits.put_symbol(data[i]);
+                insert(i);
+                ++i;
+            }
+        }
+    }
+};
+
+/**
+ * Sampled stacks aggregated by unique stack, with one value per counter (sample type). Built from
+ * the samples of a region and written as a gzip-compressed pprof profile.proto, so the output
+ * size grows with the number of distinct stacks rather than with the number of samples:
+ *
+ *   auto sampler = std::make_shared<PerfSampler>(options);
+ *   ...region...
+ *   PerfProfile::fromSamples(*sampler).writePprof("region.pb.gz");   // go tool pprof region.pb.gz
+ * */
+struct PerfProfile {
+    std::vector<std::string> value_types;                           // e.g. "cycles", "LLC-misses"
+    std::map<std::vector<uint64_t>, std::vector<int64_t>> stacks;  // ips, innermost first
+    int64_t duration_ns = 0;
+
+    static PerfProfile fromSamples(PerfSampler& sampler) {
+        PerfProfile profile;
+        for (auto& counter : sampler.options.counters) { profile.value_types.push_back(counter.name); }
+        std::lock_guard<std::mutex> guard(sampler.samples_mutex);
+        uint64_t first = UINT64_MAX, last = 0;
+        std::vector<uint64_t> stack;
+        for (auto& s : sampler.samples) {
+            stack.clear();
+            for (uint64_t ip : s.callchain) {
+                if (ip < PERF_CONTEXT_MAX) { stack.push_back(ip); }  // skip PERF_CONTEXT_* markers
+            }
+            if (stack.empty()) { stack.push_back(s.ip); }
+            profile.add(stack, s.counter, static_cast<int64_t>(s.period));
+            first = std::min(first, s.time);
+            last = std::max(last, s.time);
+        }
+        if (last > first) { profile.duration_ns = static_cast<int64_t>(last - first); }
+        return profile;
+    }
+
+    void add(const std::vector<uint64_t>& stack, unsigned value_type, int64_t value) {
+        auto& values = stacks[stack];
+        values.resize(value_types.size());
+        if (value_type < values.size()) { values[value_type] += value; }
+    }
+
+    bool writePprof(const std::string& path) const {
+        std::ofstream out(path, std::ios::binary);
+        std::string data = PerfGzip::compress(encodePprof());
+        out.write(data.data(), static_cast<std::streamsize>(data.size()));
+        if (!out) { std::cerr << "Error writing profile " << path << std::endl; }
+        return static_cast<bool>(out);
+    }
+
+    // uncompressed profile.proto (github.com/google/pprof/blob/main/proto/profile.proto)
+    std::string encodePprof() const {
+        Strings strings;
+        std::string profile;
+        for (auto& type : value_types) {
+            std::string value_type;
+            put_varint_field(value_type, 1, strings.index(type));
+            put_varint_field(value_type, 2, strings.index("events"));
+            put_bytes_field(profile, 1, value_type);
+        }
+
+        std::unordered_map<uint64_t, uint64_t> location_of;  // lookup address (ip, ip - 1 for callers) -> location id
+        std::map<std::string, uint64_t> function_of;
+        std::string locations, functions;
+        for (auto& stack : stacks) {
+            std::string ids, values;
+            for (size_t depth = 0; depth < stack.first.size(); ++depth) {
+                uint64_t ip = stack.first[depth];
+                // return addresses of callers point behind the call instruction
+                uint64_t key = depth ? ip - 1 : ip;
+                auto location = location_of.find(key);
+                if (location == location_of.end()) {
+                    std::string name = PerfJit::symbolize(reinterpret_cast<const void*>(key));
+                    auto function = function_of.find(name);
+                    if (function == function_of.end()) {
+                        function = function_of.emplace(name, function_of.size() + 1).first;
+                        std::string encoded;
+                        put_varint_field(encoded, 1, function->second);
+                        put_varint_field(encoded, 2, strings.index(name));
+                        put_varint_field(encoded, 3, strings.index(name));
+                        put_bytes_field(functions, 5, encoded);
+                    }
+                    location = location_of.emplace(key, location_of.size() + 1).first;
+                    std::string line, encoded;
+                    put_varint_field(line, 1, function->second);
+                    put_varint_field(encoded, 1, location->second);
+                    put_varint_field(encoded, 3, ip);
+                    put_bytes_field(encoded, 4, line);
+                    put_bytes_field(locations, 4, encoded);
+                }
+                put_varint(ids, location->second);
+            }
+            for (int64_t value : stack.second) { put_varint(values, static_cast<uint64_t>(value)); }
+            std::string sample;
+            put_bytes_field(sample, 1, ids);
+            put_bytes_field(sample, 2, values);
+            put_bytes_field(profile, 2, sample);
+        }
+        profile += locations;
+        profile += functions;
+        for (auto& s : strings.table) { put_bytes_field(profile, 6, s); }
+        if (duration_ns) { put_varint_field(profile, 10, static_cast<uint64_t>(duration_ns)); }
+        return profile;
+    }
+
+private:
+    struct Strings {
+        std::vector<std::string> table = {""};
+        std::unordered_map<std::string, uint64_t> index_of = {{"", 0}};
+
+        uint64_t index(const std::string& s) {
+            auto it = index_of.find(s);
+            if (it != index_of.end()) { return it->second; }
+            index_of.emplace(s, table.size());
+            table.push_back(s);
+            return table.size() - 1;
+        }
+    };
+
+    static void put_varint(std::string& out, uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    static void put_varint_field(std::string& out, unsigned field, uint64_t value) {
+        put_varint(out, field << 3);
+        put_varint(out, value);
+    }
+
+    static void put_bytes_field(std::string& out, unsigned field, const std::string& bytes) {
+        put_varint(out, (field << 3) | 2);
+        put_varint(out, bytes.size());
+        out += bytes;
+    }
+};
+
+/**
+ * A PerfProfile with symbolized stacks (outermost frame first, joined by ';'), which can be saved
+ * as folded stacks and compared across runs, since it does not depend on load addresses. The
+ * optional counter totals of the region (e.g. PerfEvent::getCounter) allow comparing absolute
+ * event counts instead of shares.
+ *
+ * File format: "# <value types...>", "# totals <per value type>", "# scale <n>", then one line
+ * "frame;frame;frame <value> <value>..." per stack.
+ * */
+struct PerfFoldedProfile {
+    std::vector<std::string> value_types;
+    std::vector<double> totals;  // counter totals of the region per value type, 0 if unknown
+    double scale = 1;            // e.g. the PerfEventBlock scale, totals are divided by it
+    std::map<std::string, std::vector<double>> stacks;
+
+    // with `perf` set, the totals are taken from its counters of the same name
+    static PerfFoldedProfile fromProfile(const PerfProfile& profile, PerfEvent* perf = nullptr, double scale = 1) {
+        PerfFoldedProfile folded;
+        folded.value_types = profile.value_types;
+        folded.scale = scale;
+        for (auto& type : profile.value_types) { folded.totals.push_back(perf && perf->getEvent(type) ? perf->getCounter(type) : 0); }
+        std::unordered_map<uint64_t, std::string> names;
+        for (auto& stack : profile.stacks) {
+            std::string line;
+            for (size_t depth = stack.first.size(); depth-- > 0;) {
+                uint64_t key = depth ? stack.first[depth] - 1 : stack.first[depth];
+                auto name = names.find(key);
+                if (name == names.end()) {
+                    std::string symbol = PerfJit::symbolize(reinterpret_cast<const void*>(key));
+                    std::replace(symbol.begin(), symbol.end(), ';', ':');
+                    name = names.emplace(key, symbol).first;
+                }
+                line += (line.empty() ? "" : ";") + name->second;
+            }
+            auto& values = folded.stacks[line];
+            values.resize(folded.value_types.size());
+            for (size_t v = 0; v < values.size() && v < stack.second.size(); ++v) { values[v] += static_cast<double>(stack.second[v]); }
+        }
+        return folded;
+    }
+
+    bool write(const std::string& path) const {
+        std::ofstream out(path);
+        out << std::setprecision(15) << "#";
+        for (auto& type : value_types) { out << " " << type; }
+        out << "\n# totals";
+        for (double total : totals) { out << " " << total; }
+        out << "\n# scale " << scale << "\n";
+        for (auto& stack : stacks) {
+            out << stack.first;
+            for (double value : stack.second) { out << " " << value; }
+            out << "\n";
+        }
+        if (!out) { std::cerr << "Error writing folded profile " << path << std::endl; }
+        return static_cast<bool>(out);
+    }
+
+    static bool read(const std::string& path, PerfFoldedProfile& folded) {
+        std::ifstream in(path);
+        std::string line;
+        if (!std::getline(in, line) || line.empty() || line[0] != '#') { return false; }
+        folded = PerfFoldedProfile();
+        std::istringstream types(line.substr(1));
+        for (std::string type; types >> type;) { folded.value_types.push_back(type); }
+        folded.totals.assign(folded.value_types.size(), 0);
+        while (std::getline(in, line)) {
+            if (line.rfind("# totals", 0) == 0) {
+                std::istringstream values(line.substr(8));
+                for (auto& total : folded.totals) { values >> total; }
+                continue;
+            }
+            if (line.rfind("# scale", 0) == 0) {
+                folded.scale = std::stod(line.substr(7));
+                continue;
+            }
+            // frames may contain spaces, the values are the last fields
+            std::vector<double> values(folded.value_types.size());
+            size_t end = line.size();
+            for (size_t v = values.size(); v-- > 0;) {
+                size_t space = line.rfind(' ', end - 1);
+                if (space == std::string::npos || end == 0) { return false; }
+                values[v] = std::stod(line.substr(space + 1, end - space - 1));
+                end = space;
+            }
+            auto& stack = folded.stacks[line.substr(0, end)];
+            stack.resize(values.size());
+            for (size_t v = 0; v < values.size(); ++v) { stack[v] += values[v]; }
+        }
+        return true;
+    }
+
+    // Factor that turns sampled values into comparable units: percent of all samples, or with
+    // `absolute` (requires totals), the events they stand for per scale unit.
+    double normalization(unsigned value_type, bool absolute) const {
+        double sum = 0;
+        for (auto& stack : stacks) { sum += value_type < stack.second.size() ? stack.second[value_type] : 0; }
+        if (!sum) { return 0; }
+        return (absolute ? totals[value_type] / scale : 100) / sum;
+    }
+};
+
+/**
+ * Compares two folded profiles, e.g. a saved baseline against the current run or two regions of
+ * one run, and ranks functions and stacks by how much they grew. Values are normalized per profile
+ * (share of samples in percent, or events per scale unit if both profiles have counter totals).
+ *
+ *   PerfProfileDiff diff(baseline, current);     // value type 0, e.g. cycles
+ *   diff.printTable(std::cout);
+ *   diff.writeFolded("diff.folded");             // flamegraph.pl diff.folded > diff.svg
+ * */
+struct PerfProfileDiff {
+    struct Entry {
+        std::string name;
+        double base = 0;
+        double current = 0;
+        double delta() const { return current - base; }
+    };
+
+    bool absolute;                 // events per scale unit instead of percent of samples
+    std::vector<Entry> functions;  // self values (leaf frames), largest growth first
+    std::vector<Entry> inclusive;  // values of stacks containing the function
+    std::vector<Entry> stacks;
+
+    PerfProfileDiff(const PerfFoldedProfile& base, const PerfFoldedProfile& current, unsigned value_type = 0)
+        : absolute(has_total(base, value_type) && has_total(current, value_type)) {
+        std::map<std::string, Entry> self, total, stack;
+        collect(base, value_type, absolute, &Entry::base, self, total, stack);
+        collect(current, value_type, absolute, &Entry::current, self, total, stack);
+        functions = ranked(self);
+        inclusive = ranked(total);
+        stacks = ranked(stack);
+    }
+
+    void printTable(std::ostream& out, size_t limit = 20) const {
+        const char* unit = absolute ? "" : " %";
+        size_t width = 8;
+        for (size_t i = 0; i < functions.size() && i < limit; ++i) { width = std::max(width, functions[i].name.size() + 1); }
+        out << std::left << std::setw(static_cast<int>(width)) << "function," << std::right << " " << std::setw(14)
+            << std::string("base") + unit << ", " << std::setw(14) << std::string("current") + unit << ", "
+            << std::setw(14) << std::string("delta") + unit << ", " << std::setw(14) << std::string("incl. delta") + unit
+            << std::endl;
+        for (size_t i = 0; i < functions.size() && i < limit; ++i) {
+            auto& f = functions[i];
+            double inclusive_delta = 0;
+            for (auto& e : inclusive) {
+                if (e.name == f.name) { inclusive_delta = e.delta(); }
+            }
+            out << std::left << std::setw(static_cast<int>(width)) << f.name + "," << std::right << std::fixed
+                << std::setprecision(2) << " " << std::setw(14) << f.base << ", " << std::setw(14) << f.current << ", "
+                << std::setw(14) << std::showpos << f.delta() << ", " << std::setw(14) << inclusive_delta
+                << std::noshowpos << std::endl;
+        }
+    }
+
+    // "stack base current" lines, the input format of flamegraph.pl for differential flame graphs
+    bool writeFolded(const std::string& path) const {
+        std::ofstream out(path);
+        for (auto& s : stacks) { out << s.name << " " << s.base << " " << s.current << "\n"; }
+        if (!out) { std::cerr << "Error writing differential profile " << path << std::endl; }
+        return static_cast<bool>(out);
+    }
+
+private:
+    static bool has_total(const PerfFoldedProfile& p, unsigned value_type) {
+        return value_type < p.totals.size() && p.totals[value_type] > 0;
+    }
+
+    static void collect(const PerfFoldedProfile& profile, unsigned value_type, bool absolute, double Entry::*side,
+                        std::map<std::string, Entry>& self, std::map<std::string, Entry>& total,
+                        std::map<std::string, Entry>& stack) {
+        double factor = profile.normalization(value_type, absolute);
+        for (auto& s : profile.stacks) {
+            double value = value_type < s.second.size() ? s.second[value_type] * factor : 0;
+            add(stack, s.first, side, value);
+            size_t leaf = s.first.rfind(';');
+            add(self, leaf == std::string::npos ? s.first : s.first.substr(leaf + 1), side, value);
+            // count recursive functions once per stack
+            std::vector<std::string> seen;
+            std::istringstream frames(s.first);
+            for (std::string frame; std::getline(frames, frame, ';');) {
+                if (std::find(seen.begin(), seen.end(), frame) != seen.end()) { continue; }
+                seen.push_back(frame);
+                add(total, frame, side, value);
+            }
+        }
+    }
+
+    static void add(std::map<std::string, Entry>& entries, const std::string& name, double Entry::*side, double value) {
+        auto& entry = entries[name];
+        entry.name = name;
+        entry.*side += value;
+    }
+
+    static std::vector<Entry> ranked(const std::map<std::string, Entry>& entries) {
+        std::vector<Entry> result;
+        for (auto& e : entries) { result.push_back(e.second); }
+        std::stable_sort(result.begin(), result.end(), [](const Entry& a, const Entry& b) { return a.delta() > b.delta(); });
+        return result;
+    }
+};
@@ -0,0 +1,514 @@
+#pragma once
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "PerfEvent.hpp"
+#include "PerfJit.hpp"
+#include "PerfUnwind.hpp"
+
+/**
+ * One decoded PERF_RECORD_SAMPLE. Fields not requested in the sample_type stay zero.
+ * */
+struct PerfSample {
+    uint32_t counter = 0;  // index into PerfSampler::options.counters
+    uint32_t pid = 0;
+    uint32_t tid = 0;
+    uint32_t cpu = 0;
+    uint64_t ip = 0;
+    uint64_t time = 0;
+    uint64_t addr = 0;
+    uint64_t period = 0;  // events this sample stands for
+    uint64_t weight = 0;    // PERF_SAMPLE_WEIGHT, e.g. the load latency in cycles
+    uint64_t data_src = 0;  // PERF_SAMPLE_DATA_SRC, a perf_mem_data_src
+    // innermost first; from the kernel (PERF_SAMPLE_CALLCHAIN, may contain PERF_CONTEXT_* markers)
+    // or, with PerfSamplerOptions::unwind_stack, the user frames unwound from the copied stack
+    std::vector<uint64_t> callchain;
+};
+
+struct PerfSampleCounter {
+    std::string name;
+    uint32_t type;
+    uint64_t config;
+    uint64_t frequency = 4000;  // samples per second, the kernel adapts the period
+    uint64_t period = 0;        // a fixed sample period instead of the frequency if set
+    uint64_t config1 = 0;       // e.g. the load latency threshold, or bp_addr for breakpoints
+    uint64_t config2 = 0;       // bp_len for breakpoints
+    uint32_t bp_type = 0;
+    uint8_t precise_ip = 0;
+
+    // Resolves a named event of a PMU from sysfs, e.g. ("cpu", "mem-loads", "ldlat=30"), where
+    // /sys/bus/event_source/devices/cpu/events/mem-loads holds "event=0xcd,umask=0x1,ldlat=3" and
+    // the format directory maps each term to bits of config, config1 or config2. `terms` are
+    // applied afterwards and override the defaults.
+    static bool fromSysfs(const std::string& pmu, const std::string& event, PerfSampleCounter& out, const std::string& terms = "") {
+        std::string dir = PerfEvent::sysfsRoot() + "/bus/event_source/devices/" + pmu;
+        std::ifstream typeIn(dir + "/type"), eventIn(dir + "/events/" + event);
+        std::string definition;
+        if (!(typeIn >> out.type) || !std::getline(eventIn, definition)) { return false; }
+        out.name = event;
+        out.config = out.config1 = out.config2 = 0;
+        std::stringstream all(definition + (terms.empty() ? "" : "," + terms));
+        for (std::string term; std::getline(all, term, ',');) {
+            auto eq = term.find('=');
+            std::string key = term.substr(0, eq);
+            uint64_t value = eq == std::string::npos ? 1 : std::stoull(term.substr(eq + 1), nullptr, 0);
+            // e.g. "config:0-7,32-35": the value's low bits are spread over these ranges
+            std::ifstream formatIn(dir + "/format/" + key);
+            std::string format;
+            if (!std::getline(formatIn, format)) { return false; }
+            auto colon = format.find(':');
+            std::string field = format.substr(0, colon);
+            uint64_t* target = field == "config" ? &out.config : field == "config1" ? &out.config1 : field == "config2" ? &out.config2 : nullptr;
+            if (!target || colon == std::string::npos) { return false; }
+            std::stringstream ranges(format.substr(colon + 1));
+            for (std::string range; std::getline(ranges, range, ',');) {
+                unsigned lo = static_cast<unsigned>(std::stoul(range)), hi = lo;
+                if (range.find('-') != std::string::npos) { hi = static_cast<unsigned>(std::stoul(range.substr(range.find('-') + 1))); }
+                for (unsigned bit = lo; bit <= hi && bit < 64; ++bit, value >>= 1) {
+                    *target = (*target & ~(1ull << bit)) | ((value & 1) << bit);
+                }
+            }
+        }
+        return true;
+    }
+};
+
+struct PerfSamplerOptions {
+    std::vector<PerfSampleCounter> counters = {
+        {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {"LLC-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    };
+    uint64_t sample_type = 0;   // in addition to IP, TID, TIME and PERIOD: ADDR, CPU, CALLCHAIN, WEIGHT, DATA_SRC
+    bool all_threads = false;   // every thread of the process at construction, otherwise the calling one
+    bool inherit = true;        // also threads the sampled threads start later, like the PerfEvent counters
+    bool exclude_kernel = true;
+    bool keep_samples = true;   // store every sample in PerfSampler::samples, off for subclasses that aggregate
+    unsigned ring_pages = 64;   // data pages per thread, rounded up to a power of two
+    // Bytes of user stack copied per sample and unwound with .eh_frame (PerfUnwinder), for binaries
+    // without frame pointers. 0 disables it; 8-16 KiB covers most stacks. Needs more ring_pages.
+    uint32_t unwind_stack = 0;
+};
+
+/**
+ * Memory-mapped sample buffer of one perf event. The kernel advances data_head, the reader
+ * consumes records up to it and hands the space back by advancing data_tail.
+ * */
+struct PerfSampleRing {
+    int fd = -1;
+    char* base = nullptr;
+    size_t page_size = 0;
+    size_t data_size = 0;
+    std::vector<char> wrapped;  // records that wrap around the end of the buffer are copied here
+
+    PerfSampleRing(int fd, unsigned pages) : fd(fd), page_size(static_cast<size_t>(sysconf(_SC_PAGESIZE))) {
+        unsigned rounded = 1;
+        while (rounded < pages) { rounded *= 2; }
+        data_size = rounded * page_size;
+        void* mem = mmap(nullptr, page_size + data_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mem != MAP_FAILED) { base = static_cast<char*>(mem); }
+    }
+
+    ~PerfSampleRing() {
+        if (base) { munmap(base, page_size + data_size); }
+    }
+
+    PerfSampleRing(const PerfSampleRing&) = delete;
+
+    explicit operator bool() const { return base != nullptr; }
+
+    // calls consume(const perf_event_header*) for every complete record
+    template <typename F>
+    void drain(F&& consume) {
+        if (!base) { return; }
+        auto* page = reinterpret_cast<perf_event_mmap_page*>(base);
+        const char* data = base + page_size;
+        uint64_t head = __atomic_load_n(&page->data_head, __ATOMIC_ACQUIRE);
+        uint64_t tail = page->data_tail;
+        while (tail < head) {
+            size_t offset = tail & (data_size - 1);
+            perf_event_header header;
+            copy(data, offset, &header, sizeof(header));
+            if (header.size < sizeof(header)) { break; }
+            if (offset + header.size <= data_size) {
+                consume(reinterpret_cast<const perf_event_header*>(data + offset));
+            } else {
+                wrapped.resize(header.size);
+                copy(data, offset, wrapped.data(), header.size);
+                consume(reinterpret_cast<const perf_event_header*>(wrapped.data()));
+            }
+            tail += header.size;
+        }
+        __atomic_store_n(&page->data_tail, tail, __ATOMIC_RELEASE);
+    }
+
+private:
+    void copy(const char* data, size_t offset, void* out, size_t size) const {
+        size_t first = std::min(size, data_size - offset);
+        memcpy(out, data + offset, first);
+        memcpy(static_cast<char*>(out) + first, data, size - first);
+    }
+};
+
+/**
+ * Samples IPs for the regions of a PerfEvent. Every counter is opened per thread; all counters of a
+ * thread write into one ring (PERF_EVENT_IOC_SET_OUTPUT) that a background thread drains, so long
+ * regions do not overflow it. After each region, `samples` holds the samples taken during it. With
+ * inherit, samples of threads started later go to the ring of the thread that started them. Threads
+ * that already exist but were not sampled at construction, e.g. without all_threads, stay unsampled.
+ *
+ *   auto sampler = std::make_shared<PerfSampler>();
+ *   PerfEvent e;
+ *   e.extensions.push_back(sampler);
+ *   { PerfEventBlock block(e, n); run(); }
+ *   for (auto& s : sampler->samples) ...
+ *
+ * Sampling uses its own perf_event_open calls and does not go through the PerfEvent backend.
+ * */
+struct PerfSampler : PerfEvent::Extension {
+    struct Thread {
+        std::vector<int> fds;  // per counter, the first one owns the ring
+        std::unique_ptr<PerfSampleRing> ring;
+    };
+
+    PerfSamplerOptions options;
+    uint64_t sample_type = 0;
+    std::vector<Thread> threads;
+    std::map<uint64_t, uint32_t> counter_of_id;  // PERF_EVENT_IOC_ID -> counter
+    std::mutex samples_mutex;                     // samples, lost, and draining the rings
+    std::vector<PerfSample> samples;
+    uint64_t lost = 0;  // samples the kernel dropped because a ring was full
+    int wakeup = -1;
+    std::atomic<bool> stopping{false};
+    std::thread drainer;
+    PerfUnwinder unwinder;
+
+    explicit PerfSampler(PerfSamplerOptions opts = PerfSamplerOptions()) : options(std::move(opts)) {
+        // decode only knows these fields, any other bit would shift the ones after it; the user
+        // registers and stack are requested through unwind_stack
+        constexpr uint64_t decodable = PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME |
+                                       PERF_SAMPLE_PERIOD | PERF_SAMPLE_ADDR | PERF_SAMPLE_CPU | PERF_SAMPLE_CALLCHAIN |
+                                       PERF_SAMPLE_WEIGHT | PERF_SAMPLE_DATA_SRC;
+        if (options.sample_type & ~decodable) {
+            std::cerr << "Ignoring unsupported sample_type bits 0x" << std::hex << (options.sample_type & ~decodable) << std::dec
+                      << std::endl;
+            options.sample_type &= decodable;
+        }
+        sample_type = PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME |
+                      PERF_SAMPLE_PERIOD | options.sample_type;
+        if (options.unwind_stack && !PerfUnwinder::supported) {
+            std::cerr << "Stack unwinding is not supported on this architecture" << std::endl;
+            options.unwind_stack = 0;
+        }
+        if (options.unwind_stack) {
+            sample_type |= PERF_SAMPLE_REGS_USER | PERF_SAMPLE_STACK_USER;
+            options.unwind_stack &= ~7u;  // the kernel requires a multiple of 8
+        }
+        std::vector<pid_t> tids = {0};
+        if (options.all_threads) { tids = PerfEvent::listThreads(getpid()); }
+        for (pid_t tid : tids) { open_thread(tid); }
+        wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (!threads.empty()) { drainer = std::thread([this] { run(); }); }
+    }
+
+    ~PerfSampler() override {
+        stopping = true;
+        uint64_t one = 1;
+        if (wakeup >= 0 && write(wakeup, &one, sizeof(one)) < 0) {}
+        if (drainer.joinable()) { drainer.join(); }
+        for (auto& thread : threads) {
+            thread.ring.reset();
+            for (int fd : thread.fds) { close(fd); }
+        }
+        if (wakeup >= 0) { close(wakeup); }
+    }
+
+    PerfSampler(const PerfSampler&) = delete;
+
+    void start(PerfEvent&) override {
+        {
+            std::lock_guard<std::mutex> guard(samples_mutex);
+            drain_all();  // discard anything from before the region
+            samples.clear();
+            lost = 0;
+            cleared();
+        }
+        control(PERF_EVENT_IOC_ENABLE);
+    }
+
+    void stop(PerfEvent&) override {
+        control(PERF_EVENT_IOC_DISABLE);
+        std::lock_guard<std::mutex> guard(samples_mutex);
+        drain_all();
+    }
+
+    // the attributes each counter is opened with
+    static perf_event_attr attr(const PerfSampleCounter& counter, const PerfSamplerOptions& options, uint64_t sample_type) {
+        perf_event_attr pe = {};
+        pe.type = counter.type;
+        pe.size = sizeof(pe);
+        pe.config = counter.config;
+        pe.config1 = counter.config1;
+        pe.config2 = counter.config2;
+        pe.bp_type = counter.bp_type;
+        pe.precise_ip = counter.precise_ip;
+        pe.freq = !counter.period;
+        if (counter.period) {
+            pe.sample_period = counter.period;
+        } else {
+            pe.sample_freq = counter.frequency;
+        }
+        pe.sample_type = sample_type;
+        pe.disabled = 1;
+        pe.inherit = options.inherit;
+        pe.exclude_kernel = options.exclude_kernel;
+        pe.exclude_hv = 1;
+        pe.sample_id_all = 1;
+        if (options.unwind_stack) {
+            pe.sample_regs_user = PerfUnwinder::sample_regs;
+            pe.sample_stack_user = options.unwind_stack;
+        }
+        pe.watermark = 1;
+        pe.wakeup_watermark = options.ring_pages * static_cast<uint32_t>(sysconf(_SC_PAGESIZE)) / 2;
+        return pe;
+    }
+
+    // Whether the counter can be opened for the calling thread. Lowers counter.precise_ip until
+    // the CPU accepts it, like perf's :P modifier.
+    static bool probe(PerfSampleCounter& counter, const PerfSamplerOptions& options = PerfSamplerOptions()) {
+        for (;;) {
+            perf_event_attr pe = attr(counter, options, PERF_SAMPLE_IP);
+            int fd = static_cast<int>(syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0));
+            if (fd >= 0) {
+                close(fd);
+                return true;
+            }
+            if (!counter.precise_ip) { return false; }
+            --counter.precise_ip;
+        }
+    }
+
+    // period-weighted event count of all samples of a counter in the last region, needs keep_samples
+    uint64_t total(uint32_t counter) const {
+        uint64_t sum = 0;
+        for (auto& s : samples) { sum += s.counter == counter ? s.period : 0; }
+        return sum;
+    }
+
+protected:
+    // hooks for subclasses that aggregate samples while they are drained, called with samples_mutex held
+    virtual void cleared() {}
+    virtual void decoded(PerfSample&) {}
+
+private:
+    void open_thread(pid_t tid) {
+        Thread thread;
+        for (uint32_t c = 0; c < options.counters.size(); ++c) {
+            auto& counter = options.counters[c];
+            perf_event_attr pe = attr(counter, options, sample_type);
+            int fd = static_cast<int>(syscall(__NR_perf_event_open, &pe, tid, -1, -1, PERF_FLAG_FD_CLOEXEC));
+            if (fd < 0) {
+                std::cerr << "Error opening sampling counter " << counter.name << std::endl;
+                continue;
+            }
+            if (!thread.ring) {
+                thread.ring.reset(new PerfSampleRing(fd, options.ring_pages));
+                if (!*thread.ring) {
+                    std::cerr << "Error mapping sample buffer" << std::endl;
+                    thread.ring.reset();
+                    close(fd);
+                    continue;
+                }
+            } else if (ioctl(fd, PERF_EVENT_IOC_SET_OUTPUT, thread.ring->fd) < 0) {
+                close(fd);
+                continue;
+            }
+            uint64_t id;
+            if (ioctl(fd, PERF_EVENT_IOC_ID, &id) == 0) { counter_of_id[id] = c; }
+            thread.fds.push_back(fd);
+        }
+        if (thread.ring) { threads.push_back(std::move(thread)); }
+    }
+
+    void control(unsigned long request) {
+        for (auto& thread : threads) {
+            for (int fd : thread.fds) { ioctl(fd, request, 0); }
+        }
+    }
+
+    void run() {
+        std::vector<pollfd> fds;
+        for (auto& thread : threads) { fds.push_back({thread.ring->fd, POLLIN, 0}); }
+        fds.push_back({wakeup, POLLIN, 0});
+        while (!stopping) {
+            if (poll(fds.data(), fds.size(), 100) < 0 && errno != EINTR) { break; }
+            std::lock_guard<std::mutex> guard(samples_mutex);
+            drain_all();
+        }
+    }
+
+    void drain_all() {
+        for (auto& thread : threads) {
+            thread.ring->drain([this](const perf_event_header* header) { consume(header); });
+        }
+    }
+
+    void consume(const perf_event_header* header) {
+        if (header->type == PERF_RECORD_LOST) {
+            uint64_t count;
+            memcpy(&count, reinterpret_cast<const char*>(header) + sizeof(*header) + sizeof(uint64_t), sizeof(count));
+            lost += count;
+            return;
+        }
+        if (header->type != PERF_RECORD_SAMPLE) { return; }
+        PerfSample sample;
+        if (decode(header, sample)) {
+            decoded(sample);
+            if (options.keep_samples) { samples.push_back(std::move(sample)); }
+        }
+    }
+
+    // fields appear in the order of the PERF_SAMPLE_* bits, see perf_event_open(2)
+    bool decode(const perf_event_header* header, PerfSample& s) {
+        const char* p = reinterpret_cast<const char*>(header) + sizeof(*header);
+        const char* end = reinterpret_cast<const char*>(header) + header->size;
+        auto next = [&](void* out, size_t size) {
+            if (p + size > end) { return false; }
+            memcpy(out, p, size);
+            p += size;
+            return true;
+        };
+        uint64_t id;
+        if (!next(&id, sizeof(id))) { return false; }
+        auto counter = counter_of_id.find(id);
+        if (counter == counter_of_id.end()) { return false; }
+        s.counter = counter->second;
+        if (sample_type & PERF_SAMPLE_IP && !next(&s.ip, sizeof(s.ip))) { return false; }
+        if (sample_type & PERF_SAMPLE_TID && (!next(&s.pid, sizeof(s.pid)) || !next(&s.tid, sizeof(s.tid)))) { return false; }
+        if (sample_type & PERF_SAMPLE_TIME && !next(&s.time, sizeof(s.time))) { return false; }
+        if (sample_type & PERF_SAMPLE_ADDR && !next(&s.addr, sizeof(s.addr))) { return false; }
+        if (sample_type & PERF_SAMPLE_CPU) {
+            uint32_t reserved;
+            if (!next(&s.cpu, sizeof(s.cpu)) || !next(&reserved, sizeof(reserved))) { return false; }
+        }
+        if (sample_type & PERF_SAMPLE_PERIOD && !next(&s.period, sizeof(s.period))) { return false; }
+        if (sample_type & PERF_SAMPLE_CALLCHAIN) {
+            uint64_t nr;
+            if (!next(&nr, sizeof(nr)) || nr > static_cast<uint64_t>(end - p) / sizeof(uint64_t)) { return false; }
+            s.callchain.resize(nr);
+            next(s.callchain.data(), nr * sizeof(uint64_t));
+        }
+        if (sample_type & PERF_SAMPLE_REGS_USER) {
+            uint64_t abi;
+            if (!next(&abi, sizeof(abi))) { return false; }
+            uint64_t regs[3] = {};
+            if (abi != PERF_SAMPLE_REGS_ABI_NONE && !next(regs, sizeof(regs))) { return false; }
+            uint64_t size = 0, used = 0;
+            const char* stack = nullptr;
+            if (sample_type & PERF_SAMPLE_STACK_USER) {
+                if (!next(&size, sizeof(size)) || size > static_cast<uint64_t>(end - p)) { return false; }
+                stack = p;
+                p += size;
+                if (size && !next(&used, sizeof(used))) { return false; }
+            }
+            // samples taken in the kernel have no user registers
+            if (abi != PERF_SAMPLE_REGS_ABI_NONE) {
+                s.callchain.clear();
+                unwinder.unwind(regs, stack, std::min(size, used), s.callchain);
+            }
+        }
+        if (sample_type & PERF_SAMPLE_WEIGHT && !next(&s.weight, sizeof(s.weight))) { return false; }
+        if (sample_type & PERF_SAMPLE_DATA_SRC && !next(&s.data_src, sizeof(s.data_src))) { return false; }
+        return true;
+    }
+};
+
+/**
+ * Splits the sampled counters of each region by the JIT-compiled function (PerfJit::registerCode)
+ * the samples hit. With `out` set, every region prints a table of per-function shares, e.g.
+ *
+ *   function,         cycles %, LLC-misses %
+ *   q42::probe,          61.20,        83.75
+ *   q42::build,          30.02,        12.10
+ *   [not jit],            8.78,         4.15
+ * */
+struct PerfJitAttribution : PerfSampler {
+    struct Row {
+        std::string function;
+        std::vector<uint64_t> weight;  // period-weighted samples per counter
+    };
+
+    std::ostream* out;
+    std::vector<Row> rows;  // of the last region, by descending weight of the first counter
+
+    explicit PerfJitAttribution(std::ostream* out = nullptr, PerfSamplerOptions options = PerfSamplerOptions())
+        : PerfSampler(aggregating(std::move(options))), out(out) {}
+
+    void stop(PerfEvent& e) override {
+        PerfSampler::stop(e);
+        {
+            std::lock_guard<std::mutex> guard(samples_mutex);
+            rows.clear();
+            for (auto& entry : weights) { rows.push_back({entry.first, entry.second}); }
+        }
+        std::stable_sort(rows.begin(), rows.end(), [](const Row& a, const Row& b) { return a.weight[0] > b.weight[0]; });
+        if (out) { print(*out); }
+    }
+
+    // share of a counter's samples in a function, in percent
+    double share(const Row& row, uint32_t counter) const {
+        uint64_t sum = 0;
+        for (auto& r : rows) { sum += r.weight[counter]; }
+        return sum ? 100.0 * static_cast<double>(row.weight[counter]) / static_cast<double>(sum) : 0;
+    }
+
+    void print(std::ostream& os) const {
+        size_t width = 12;
+        for (auto& row : rows) { width = std::max(width, row.function.size() + 1); }
+        os << std::left << std::setw(static_cast<int>(width)) << "function," << std::right;
+        for (uint32_t c = 0; c < options.counters.size(); ++c) {
+            os << (c ? ", " : " ") << std::setw(12) << options.counters[c].name + " %";
+        }
+        os << std::endl;
+        for (auto& row : rows) {
+            os << std::left << std::setw(static_cast<int>(width)) << row.function + "," << std::right;
+            for (uint32_t c = 0; c < options.counters.size(); ++c) {
+                os << (c ? ", " : " ") << std::setw(12) << std::fixed << std::setprecision(2) << share(row, c);
+            }
+            os << std::endl;
+        }
+    }
+
+protected:
+    // samples are attributed while they are drained, so code freed later in the region still counts
+    void cleared() override { weights.clear(); }
+
+    void decoded(PerfSample& s) override {
+        PerfJit::Symbol symbol;
+        auto& weight = weights[PerfJit::lookup(reinterpret_cast<const void*>(s.ip), symbol) ? symbol.name : "[not jit]"];
+        weight.resize(options.counters.size());
+        weight[s.counter] += s.period;
+    }
+
+private:
+    std::map<std::string, std::vector<uint64_t>> weights;
+
+    static PerfSamplerOptions aggregating(PerfSamplerOptions options) {
+        options.keep_samples = false;
+        return options;
+    }
+};
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <string>
+
+#include "PerfEvent.hpp"
+
+/**
+ * Binary layout of the POSIX shared-memory segment written by PerfShmPublisher.
+ * All counters are totals since the publisher was created; readers compute rates from two snapshots.
+ * Writers bump `sequence` to an odd value before and to an even value after an update (seqlock),
+ * readers retry until they observe the same even value before and after copying.
+ * */
+struct PerfShmLayout {
+    static constexpr uint32_t magic_value = 0x53564550;  // "PEVS"
+    static constexpr uint32_t current_version = 1;
+    static constexpr unsigned max_counters = 32;
+    static constexpr unsigned max_name = 32;
+
+    uint32_t magic;
+    uint32_t version;
+    std::atomic<uint64_t> sequence;
+    std::atomic<uint64_t> timestamp_ns;  // CLOCK_MONOTONIC of the last update
+    std::atomic<uint64_t> regions;       // completed PerfEvent regions
+    std::atomic<uint64_t> duration_ns;   // time spent in regions, including a running one
+    std::atomic<uint64_t> counter_count;
+    char names[max_counters][max_name];
+    std::atomic<uint64_t> values[max_counters];
+
+    struct Snapshot {
+        uint64_t timestamp_ns;
+        uint64_t regions;
+        uint64_t duration_ns;
+        unsigned counter_count;
+        char names[max_counters][max_name];
+        uint64_t values[max_counters];
+
+        double value(const char* name) const {
+            for (unsigned i = 0; i < counter_count; ++i) {
+                if (!strcmp(names[i], name)) { return static_cast<double>(values[i]); }
+            }
+            return 0;
+        }
+    };
+
+    Snapshot read() const {
+        Snapshot s;
+        while (true) {
+            uint64_t before = sequence.load(std::memory_order_acquire);
+            if (before & 1) { continue; }
+            s.timestamp_ns = timestamp_ns.load(std::memory_order_relaxed);
+            s.regions = regions.load(std::memory_order_relaxed);
+            s.duration_ns = duration_ns.load(std::memory_order_relaxed);
+            s.counter_count = static_cast<unsigned>(std::min<uint64_t>(counter_count.load(std::memory_order_relaxed), max_counters));
+            memcpy(s.names, names, sizeof(names));
+            for (unsigned i = 0; i < s.counter_count; ++i) { s.values[i] = values[i].load(std::memory_order_relaxed); }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sequence.load(std::memory_order_relaxed) == before) { return s; }
+        }
+    }
+
+    static uint64_t now_ns() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec);
+    }
+};
+
+/**
+ * Publishes the counters of every region measured by a PerfEvent into /dev/shm, where external
+ * dashboards (e.g. the perf-shm tool) can read them without any syscall in the measured process.
+ *
+ *   auto shm = std::make_shared<PerfShmPublisher>("/perfevent-bench");
+ *   PerfEvent e;
+ *   e.extensions.push_back(shm);
+ *   { PerfEventBlock block(e, n); run(); }   // or shm->publishRunning(e) for progress within a region
+ * */
+struct PerfShmPublisher : PerfEvent::Extension {
+    std::string name;
+    PerfShmLayout* layout = nullptr;
+    std::mutex writer_mutex;  // serializes writers, readers are lock-free
+    double totals[PerfShmLayout::max_counters] = {};
+    uint64_t total_duration_ns = 0;
+
+    explicit PerfShmPublisher(std::string shm_name = "/perfevent-" + std::to_string(getpid()))
+        : name(std::move(shm_name)) {
+        int fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+        if (fd < 0 || ftruncate(fd, sizeof(PerfShmLayout)) < 0) {
+            std::cerr << "Error creating shared memory " << name << std::endl;
+            if (fd >= 0) { close(fd); }
+            return;
+        }
+        void* mem = mmap(nullptr, sizeof(PerfShmLayout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED) {
+            std::cerr << "Error mapping shared memory " << name << std::endl;
+            return;
+        }
+        layout = new (mem) PerfShmLayout();
+        layout->magic = PerfShmLayout::magic_value;
+        layout->version = PerfShmLayout::current_version;
+    }
+
+    ~PerfShmPublisher() override {
+        if (!layout) { return; }
+        munmap(layout, sizeof(PerfShmLayout));
+        shm_unlink(name.c_str());
+    }
+
+    PerfShmPublisher(const PerfShmPublisher&) = delete;
+
+    void stop(PerfEvent& e) override {
+        std::lock_guard<std::mutex> guard(writer_mutex);
+        for (unsigned i = 0; i < e.events.size(); ++i) {
+            double value = e.events[i].readCounter();
+            int slot = slot_for(e.names[i]);
+            if (slot >= 0 && std::isfinite(value)) { totals[slot] += value; }
+        }
+        total_duration_ns += static_cast<uint64_t>(e.getDuration() * 1e9);
+        store_totals(nullptr, total_duration_ns, 1);
+    }
+
+    // publishes the totals including the progress of the region `e` is currently measuring
+    void publishRunning(PerfEvent& e) {
+        std::lock_guard<std::mutex> guard(writer_mutex);
+        double running[PerfShmLayout::max_counters] = {};
+        for (unsigned i = 0; i < e.events.size(); ++i) {
+            PerfEvent::event::read_format current;
+            int slot = slot_for(e.names[i]);
+            if (slot < 0 || !e.events[i].readInto(current)) { continue; }
+            double value = PerfEvent::event::delta(e.events[i].prev, current);
+            if (std::isfinite(value)) { running[slot] = value; }
+        }
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - e.startTime);
+        store_totals(running, total_duration_ns + static_cast<uint64_t>(elapsed.count()), 0);
+    }
+
+private:
+    int slot_for(const std::string& counter) {
+        if (!layout) { return -1; }
+        unsigned n = static_cast<unsigned>(layout->counter_count.load(std::memory_order_relaxed));
+        for (unsigned i = 0; i < n; ++i) {
+            if (counter == layout->names[i]) { return static_cast<int>(i); }
+        }
+        if (n == PerfShmLayout::max_counters) { return -1; }
+        layout->sequence.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        snprintf(layout->names[n], PerfShmLayout::max_name, "%s", counter.c_str());
+        layout->counter_count.store(n + 1, std::memory_order_relaxed);
+        layout->sequence.fetch_add(1, std::memory_order_release);
+        return static_cast<int>(n);
+    }
+
+    void store_totals(const double* running, uint64_t duration_ns, uint64_t completed) {
+        if (!layout) { return; }
+        layout->sequence.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        unsigned n = static_cast<unsigned>(layout->counter_count.load(std::memory_order_relaxed));
+        for (unsigned i = 0; i < n; ++i) {
+            double value = totals[i] + (running ? running[i] : 0);
+            layout->values[i].store(static_cast<uint64_t>(std::llround(value)), std::memory_order_relaxed);
+        }
+        layout->duration_ns.store(duration_ns, std::memory_order_relaxed);
+        layout->regions.fetch_add(completed, std::memory_order_relaxed);
+        layout->timestamp_ns.store(PerfShmLayout::now_ns(), std::memory_order_relaxed);
+        layout->sequence.fetch_add(1, std::memory_order_release);
+    }
+};
+
+/**
+ * Read-only view of a segment written by PerfShmPublisher, see perf-shm.cpp.
+ * */
+struct PerfShmReader {
+    const PerfShmLayout* layout = nullptr;
+
+    explicit PerfShmReader(const std::string& name) {
+        int fd = shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+        if (fd < 0) { return; }
+        void* mem = mmap(nullptr, sizeof(PerfShmLayout), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED) { return; }
+        layout = static_cast<const PerfShmLayout*>(mem);
+        if (layout->magic != PerfShmLayout::magic_value || layout->version != PerfShmLayout::current_version) {
+            std::cerr << "Unsupported shared memory layout in " << name << std::endl;
+            munmap(mem, sizeof(PerfShmLayout));
+            layout = nullptr;
+        }
+    }
+
+    ~PerfShmReader() {
+        if (layout) { munmap(const_cast<PerfShmLayout*>(layout), sizeof(PerfShmLayout)); }
+    }
+
+    PerfShmReader(const PerfShmReader&) = delete;
+
+    explicit operator bool() const { return layout != nullptr; }
+
+    PerfShmLayout::Snapshot read() const { return layout->read(); }
+};
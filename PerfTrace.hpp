@@ -0,0 +1,220 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * Binary trace file written incrementally by the BackgroundTracker streaming mode.
+ *
+ * Layout: Header | Chunk Footer | Chunk Footer | ...
+ *  - a Chunk is a ChunkHeader followed by `count` Records
+ *  - each Footer holds the name table and the offsets of all chunks written so far
+ *  - Header::footer is only updated once a chunk and its footer are completely written, so if the
+ *    process dies at any point the file still describes every chunk before the last footer.
+ * The file is written through a sliding window mapping that is pre-faulted with MAP_POPULATE, so the
+ * writer never faults on fresh pages and only the window stays resident.
+ * */
+struct PerfTraceFile {
+    static constexpr uint64_t header_magic = 0x31434152544650ull;  // "PFTRAC1"
+    static constexpr uint64_t chunk_magic = 0x4b4e484350ull;       // "PCHNK"
+    static constexpr uint64_t footer_magic = 0x52544f4f4650ull;    // "PFOOTR"
+    static constexpr uint32_t current_version = 1;
+
+    struct Header {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t record_size;
+        uint64_t footer;  // offset of the latest complete footer, 0 if no chunk was written yet
+    };
+    struct ChunkHeader {
+        uint64_t magic;
+        uint64_t count;
+    };
+    struct Record {
+        // the upper bits of `type` hold the Kind, the lower ones the index into the name table
+        static constexpr unsigned kind_shift = 30;
+        static constexpr uint32_t name_mask = (1u << kind_shift) - 1;
+        enum Kind : uint32_t { VALUE, MARK, SPAN_BEGIN, SPAN_END };
+
+        uint32_t type;
+        uint32_t reserved;
+        int64_t time_ns;  // steady_clock time since epoch
+        uint64_t value;
+
+        static constexpr uint32_t make_type(Kind kind, uint32_t name) { return (kind << kind_shift) | name; }
+        static constexpr Kind kind_of(uint32_t type) { return static_cast<Kind>(type >> kind_shift); }
+        static constexpr uint32_t name_of(uint32_t type) { return type & name_mask; }
+    };
+
+    // event column of a record in CSV output, e.g. "LLC-misses" or "begin:GC"
+    static std::string label(uint32_t type, const std::vector<std::string>& names) {
+        static const char* prefix[] = {"", "mark:", "begin:", "end:"};
+        uint32_t name = Record::name_of(type);
+        return prefix[Record::kind_of(type)] + (name < names.size() ? names[name] : std::to_string(name));
+    }
+    struct FooterHeader {
+        uint64_t magic;
+        uint64_t chunk_count;
+        uint64_t name_count;
+        uint64_t names_size;  // bytes of the name table, each name is zero terminated
+    };
+
+    int fd = -1;
+    std::mutex append_mutex;
+    std::vector<uint64_t> chunks;
+    uint64_t end = sizeof(Header);
+    uint64_t file_size = 0;
+    size_t window_size;
+    char* window = nullptr;
+    uint64_t window_begin = 0;
+    size_t window_length = 0;
+
+    explicit PerfTraceFile(const std::string& path, size_t window_size = 16 << 20)
+        : window_size(window_size) {
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            std::cerr << "Error creating trace file " << path << std::endl;
+            return;
+        }
+        Header header{header_magic, current_version, sizeof(Record), 0};
+        if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+            std::cerr << "Error writing trace file " << path << std::endl;
+            close(fd);
+            fd = -1;
+        }
+        file_size = sizeof(Header);
+    }
+
+    ~PerfTraceFile() {
+        if (window) { munmap(window, window_length); }
+        if (fd >= 0) {
+            if (ftruncate(fd, static_cast<off_t>(end)) < 0) { std::cerr << "Error truncating trace file" << std::endl; }
+            close(fd);
+        }
+    }
+
+    PerfTraceFile(const PerfTraceFile&) = delete;
+
+    explicit operator bool() const { return fd >= 0; }
+
+    // appends one chunk and a footer describing all chunks, callable from any thread
+    bool append(const Record* records, size_t count, const std::vector<std::string>& names) {
+        if (fd < 0 || !count) { return fd >= 0; }
+        std::lock_guard<std::mutex> guard(append_mutex);
+
+        uint64_t names_size = 0;
+        for (auto& name : names) { names_size += name.size() + 1; }
+        uint64_t chunk_size = sizeof(ChunkHeader) + count * sizeof(Record);
+        uint64_t footer_size = align(sizeof(FooterHeader) + (chunks.size() + 1) * sizeof(uint64_t) + names_size);
+        char* out = reserve(end, chunk_size + footer_size);
+        if (!out) { return false; }
+
+        ChunkHeader chunk{chunk_magic, count};
+        memcpy(out, &chunk, sizeof(chunk));
+        memcpy(out + sizeof(chunk), records, count * sizeof(Record));
+        chunks.push_back(end);
+
+        char* footer = out + chunk_size;
+        FooterHeader footer_header{footer_magic, chunks.size(), names.size(), names_size};
+        memcpy(footer, &footer_header, sizeof(footer_header));
+        footer += sizeof(footer_header);
+        memcpy(footer, chunks.data(), chunks.size() * sizeof(uint64_t));
+        footer += chunks.size() * sizeof(uint64_t);
+        for (auto& name : names) {
+            memcpy(footer, name.c_str(), name.size() + 1);
+            footer += name.size() + 1;
+        }
+
+        // publish the footer only after chunk and footer are complete
+        uint64_t footer_offset = end + chunk_size;
+        end += chunk_size + footer_size;
+        return pwrite(fd, &footer_offset, sizeof(footer_offset), offsetof(Header, footer)) == sizeof(footer_offset);
+    }
+
+    // Reads a (possibly truncated) trace, returns false if the file is not a trace or is corrupt.
+    // Every offset and count is checked against the file size before it is used.
+    static bool read(const std::string& path, std::vector<std::string>& names, std::vector<Record>& records) {
+        std::ifstream in(path, std::ios::binary);
+        std::vector<char> file((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        uint64_t size = file.size();
+        // [offset, offset + length) lies within the file, without overflowing
+        auto inside = [size](uint64_t offset, uint64_t length) { return offset <= size && length <= size - offset; };
+        Header header;
+        if (!inside(0, sizeof(header))) { return false; }
+        memcpy(&header, file.data(), sizeof(header));
+        if (header.magic != header_magic || header.version != current_version || header.record_size != sizeof(Record)) {
+            return false;
+        }
+        if (!header.footer) { return true; }
+
+        FooterHeader footer;
+        if (!inside(header.footer, sizeof(footer))) { return false; }
+        memcpy(&footer, file.data() + header.footer, sizeof(footer));
+        uint64_t index = header.footer + sizeof(footer);
+        if (footer.magic != footer_magic || footer.chunk_count > (size - index) / sizeof(uint64_t)) { return false; }
+        uint64_t name = index + footer.chunk_count * sizeof(uint64_t);
+        if (!inside(name, footer.names_size)) { return false; }
+        uint64_t names_end = name + footer.names_size;
+        for (uint64_t i = 0; i != footer.name_count; ++i) {
+            const char* begin = file.data() + name;
+            const void* terminator = memchr(begin, 0, names_end - name);
+            if (!terminator) { return false; }
+            names.emplace_back(begin, static_cast<const char*>(terminator));
+            name += names.back().size() + 1;
+        }
+        for (uint64_t i = 0; i != footer.chunk_count; ++i) {
+            uint64_t offset;
+            ChunkHeader chunk;
+            memcpy(&offset, file.data() + index + i * sizeof(uint64_t), sizeof(offset));
+            if (!inside(offset, sizeof(chunk))) { return false; }
+            memcpy(&chunk, file.data() + offset, sizeof(chunk));
+            if (chunk.magic != chunk_magic || chunk.count > (size - offset - sizeof(chunk)) / sizeof(Record)) { return false; }
+            size_t first = records.size();
+            records.resize(first + chunk.count);
+            memcpy(&records[first], file.data() + offset + sizeof(chunk), chunk.count * sizeof(Record));
+        }
+        return true;
+    }
+
+private:
+    static uint64_t align(uint64_t size) { return (size + 7) & ~uint64_t(7); }
+
+    // maps [offset, offset + size) writable, moving the window forward if needed
+    char* reserve(uint64_t offset, uint64_t size) {
+        if (window && offset >= window_begin && offset + size <= window_begin + window_length) {
+            return window + (offset - window_begin);
+        }
+        if (window) { munmap(window, window_length); }
+        window = nullptr;
+        uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+        window_begin = offset & ~(page - 1);
+        window_length = std::max<uint64_t>(window_size, (offset + size - window_begin + page - 1) & ~(page - 1));
+        if (window_begin + window_length > file_size) {
+            file_size = window_begin + window_length;
+            if (ftruncate(fd, static_cast<off_t>(file_size)) < 0) {
+                std::cerr << "Error growing trace file" << std::endl;
+                return nullptr;
+            }
+        }
+        void* mem = mmap(nullptr, window_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                         static_cast<off_t>(window_begin));
+        if (mem == MAP_FAILED) {
+            std::cerr << "Error mapping trace file" << std::endl;
+            return nullptr;
+        }
+        window = static_cast<char*>(mem);
+        return window + (offset - window_begin);
+    }
+};
@@ -0,0 +1,483 @@
+#pragma once
+
+#include <link.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <asm/perf_regs.h>
+#endif
+
+/**
+ * Unwinds user stacks copied by PERF_SAMPLE_REGS_USER | PERF_SAMPLE_STACK_USER for binaries built
+ * without frame pointers, using the .eh_frame unwind tables of the objects loaded in this process.
+ *
+ * The CFA programs of an object are evaluated once, the first time one of its addresses is
+ * unwound, into a sorted table of compact rows (how to find the CFA, the return address, and the
+ * saved frame pointer at each pc). Row lookups are cached by return address, since the same call
+ * sites appear in almost every sample. Code without unwind info (e.g. JIT code) is unwound through
+ * the frame pointer if it looks valid. Only x86-64 is supported, elsewhere `supported` is false.
+ *
+ * Not thread-safe; PerfSampler only calls it while holding its sample lock.
+ * */
+struct PerfUnwinder {
+#if defined(__x86_64__)
+    static constexpr bool supported = true;
+    // sampled registers, they appear in the record in this (bit) order
+    static constexpr uint64_t sample_regs = (1ull << PERF_REG_X86_BP) | (1ull << PERF_REG_X86_SP) | (1ull << PERF_REG_X86_IP);
+#else
+    static constexpr bool supported = false;
+    static constexpr uint64_t sample_regs = 0;
+#endif
+    enum SampleReg { BP, SP, IP };
+    static constexpr unsigned max_cache = 1 << 16;
+
+    struct Row {
+        enum Flags : uint8_t { VALID = 1, CFA_FROM_BP = 2, BP_SAVED = 4 };
+        uint64_t pc;
+        int32_t cfa_offset;
+        int16_t ra_offset;  // relative to the CFA
+        int16_t bp_offset;  // relative to the CFA, if BP_SAVED
+        uint8_t flags;
+    };
+
+    // one loaded ELF object, its .eh_frame covers all of its executable segments
+    struct Object {
+        std::vector<std::pair<uintptr_t, uintptr_t>> segments;  // [begin, end) of each executable PT_LOAD
+        const uint8_t* eh_frame_hdr;
+        const uint8_t* segment_end;  // end of the mapped segment holding the unwind info
+        bool parsed = false;
+        std::vector<Row> rows;
+    };
+
+    std::vector<Object> objects;
+    unsigned long long loaded_generation = ~0ull;  // dlpi_adds + dlpi_subs when objects was loaded
+    std::unordered_map<uint64_t, Row> cache;
+    unsigned max_depth = 128;
+
+    // Appends the ips of all frames, innermost first. `stack` is the user stack copied at `sp`.
+    void unwind(const uint64_t* regs, const char* stack, size_t size, std::vector<uint64_t>& ips) {
+        uint64_t ip = regs[IP], sp = regs[SP], bp = regs[BP];
+        auto read = [&](uint64_t addr, uint64_t& out) {
+            if (addr < regs[SP] || addr + sizeof(out) > regs[SP] + size) { return false; }
+            memcpy(&out, stack + (addr - regs[SP]), sizeof(out));
+            return true;
+        };
+        for (unsigned depth = 0; depth < max_depth && ip; ++depth) {
+            ips.push_back(ip);
+            // return addresses point behind the call, which may be the start of the next function
+            Row row = find(depth ? ip - 1 : ip);
+            uint64_t ra, cfa;
+            if (row.flags & Row::VALID) {
+                cfa = ((row.flags & Row::CFA_FROM_BP) ? bp : sp) + static_cast<int64_t>(row.cfa_offset);
+                if (!read(cfa + static_cast<int64_t>(row.ra_offset), ra)) { break; }
+                if ((row.flags & Row::BP_SAVED) && !read(cfa + static_cast<int64_t>(row.bp_offset), bp)) { break; }
+            } else {
+                cfa = bp + 16;
+                if (bp < sp || !read(bp + 8, ra) || !read(bp, bp)) { break; }
+            }
+            if (cfa <= sp) { break; }
+            sp = cfa;
+            ip = ra;
+        }
+    }
+
+    Row find(uint64_t pc) {
+        auto cached = cache.find(pc);
+        if (cached != cache.end()) { return cached->second; }
+        Row row{pc, 0, 0, 0, 0};
+        if (Object* object = object_of(pc)) {
+            if (!object->parsed) { parse(*object); }
+            auto it = std::upper_bound(object->rows.begin(), object->rows.end(), pc,
+                                       [](uint64_t p, const Row& r) { return p < r.pc; });
+            if (it != object->rows.begin()) { row = *std::prev(it); }
+        }
+        if (cache.size() >= max_cache) { cache.clear(); }
+        cache.emplace(pc, row);
+        return row;
+    }
+
+private:
+    Object* object_of(uintptr_t pc) {
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            for (auto& object : objects) {
+                for (auto& segment : object.segments) {
+                    if (pc >= segment.first && pc < segment.second) { return &object; }
+                }
+            }
+            if (attempt == 0 && !load_objects()) { break; }  // e.g. after a dlopen
+        }
+        return nullptr;
+    }
+
+    static unsigned long long generation() {
+        unsigned long long result = 0;
+        dl_iterate_phdr(
+            [](dl_phdr_info* info, size_t, void* data) {
+                *static_cast<unsigned long long*>(data) = info->dlpi_adds + info->dlpi_subs;
+                return 1;
+            },
+            &result);
+        return result;
+    }
+
+    // returns false if no object was loaded or unloaded since the last call
+    bool load_objects() {
+        unsigned long long current = generation();
+        if (current == loaded_generation) { return false; }
+        loaded_generation = current;
+        std::vector<Object> found;
+        dl_iterate_phdr(
+            [](dl_phdr_info* info, size_t, void* data) {
+                auto& found = *static_cast<std::vector<Object>*>(data);
+                const ElfW(Phdr)* hdr = nullptr;
+                for (int i = 0; i < info->dlpi_phnum; ++i) {
+                    if (info->dlpi_phdr[i].p_type == PT_GNU_EH_FRAME) { hdr = &info->dlpi_phdr[i]; }
+                }
+                Object object{{}, nullptr, nullptr, false, {}};
+                for (int i = 0; i < info->dlpi_phnum; ++i) {
+                    auto& phdr = info->dlpi_phdr[i];
+                    if (phdr.p_type != PT_LOAD) { continue; }
+                    if (phdr.p_flags & PF_X) {
+                        object.segments.emplace_back(info->dlpi_addr + phdr.p_vaddr, info->dlpi_addr + phdr.p_vaddr + phdr.p_memsz);
+                    }
+                    if (hdr && hdr->p_vaddr >= phdr.p_vaddr && hdr->p_vaddr < phdr.p_vaddr + phdr.p_memsz) {
+                        object.eh_frame_hdr = reinterpret_cast<const uint8_t*>(info->dlpi_addr + hdr->p_vaddr);
+                        object.segment_end = reinterpret_cast<const uint8_t*>(info->dlpi_addr + phdr.p_vaddr + phdr.p_memsz);
+                    }
+                }
+                if (!object.segments.empty()) { found.push_back(std::move(object)); }
+                return 0;
+            },
+            &found);
+        // keep the tables of objects that are still loaded
+        for (auto& object : found) {
+            for (auto& old : objects) {
+                if (old.segments == object.segments && old.eh_frame_hdr == object.eh_frame_hdr) {
+                    object.parsed = old.parsed;
+                    object.rows = std::move(old.rows);
+                }
+            }
+        }
+        objects = std::move(found);
+        cache.clear();
+        return true;
+    }
+
+    // DWARF register numbers on x86-64
+    static constexpr unsigned dwarf_bp = 6, dwarf_sp = 7, dwarf_ra = 16;
+
+    enum : uint8_t {
+        DW_EH_PE_omit = 0xff, DW_EH_PE_uleb128 = 0x01, DW_EH_PE_udata2 = 0x02, DW_EH_PE_udata4 = 0x03,
+        DW_EH_PE_udata8 = 0x04, DW_EH_PE_sleb128 = 0x09, DW_EH_PE_sdata2 = 0x0a, DW_EH_PE_sdata4 = 0x0b,
+        DW_EH_PE_sdata8 = 0x0c, DW_EH_PE_pcrel = 0x10, DW_EH_PE_datarel = 0x30, DW_EH_PE_indirect = 0x80,
+    };
+
+    struct Cie {
+        uint64_t code_align = 1;
+        int64_t data_align = 1;
+        uint64_t ra_register = dwarf_ra;
+        uint8_t fde_encoding = 0;
+        bool augmented = false;
+        const uint8_t* instructions = nullptr;
+        const uint8_t* end = nullptr;
+    };
+
+    // CFA rule and the registers the unwinder needs
+    struct State {
+        unsigned cfa_register = dwarf_sp;
+        int64_t cfa_offset = 8;
+        bool cfa_expression = false;
+        bool ra_saved = false;
+        int64_t ra_offset = 0;
+        bool bp_saved = false;
+        int64_t bp_offset = 0;
+        bool unsupported = false;  // e.g. an expression rule for the return address
+    };
+
+    static uint64_t uleb(const uint8_t*& p) {
+        uint64_t result = 0;
+        unsigned shift = 0;
+        uint8_t byte;
+        do {
+            byte = *p++;
+            if (shift < 64) { result |= static_cast<uint64_t>(byte & 0x7f) << shift; }
+            shift += 7;
+        } while (byte & 0x80);
+        return result;
+    }
+
+    static int64_t sleb(const uint8_t*& p) {
+        int64_t result = 0;
+        unsigned shift = 0;
+        uint8_t byte;
+        do {
+            byte = *p++;
+            if (shift < 64) { result |= static_cast<int64_t>(byte & 0x7f) << shift; }
+            shift += 7;
+        } while (byte & 0x80);
+        if (shift < 64 && (byte & 0x40)) { result |= -(int64_t(1) << shift); }
+        return result;
+    }
+
+    template <typename T>
+    static T fixed(const uint8_t*& p) {
+        T value;
+        memcpy(&value, p, sizeof(value));
+        p += sizeof(value);
+        return value;
+    }
+
+    static uint64_t encoded(const uint8_t*& p, uint8_t encoding, const uint8_t* datarel) {
+        if (encoding == DW_EH_PE_omit) { return 0; }
+        const uint8_t* field = p;
+        uint64_t value;
+        switch (encoding & 0x0f) {
+            case DW_EH_PE_uleb128: value = uleb(p); break;
+            case DW_EH_PE_udata2: value = fixed<uint16_t>(p); break;
+            case DW_EH_PE_udata4: value = fixed<uint32_t>(p); break;
+            case DW_EH_PE_sleb128: value = static_cast<uint64_t>(sleb(p)); break;
+            case DW_EH_PE_sdata2: value = static_cast<uint64_t>(static_cast<int64_t>(fixed<int16_t>(p))); break;
+            case DW_EH_PE_sdata4: value = static_cast<uint64_t>(static_cast<int64_t>(fixed<int32_t>(p))); break;
+            default: value = fixed<uint64_t>(p); break;  // absptr, udata8, sdata8
+        }
+        switch (encoding & 0x70) {
+            case DW_EH_PE_pcrel: value += reinterpret_cast<uintptr_t>(field); break;
+            case DW_EH_PE_datarel: value += reinterpret_cast<uintptr_t>(datarel); break;
+            default: break;
+        }
+        if (encoding & DW_EH_PE_indirect) { value = *reinterpret_cast<const uint64_t*>(value); }
+        return value;
+    }
+
+    void parse(Object& object) {
+        object.parsed = true;
+        if (!object.eh_frame_hdr || !object.segment_end || object.eh_frame_hdr[0] != 1) { return; }
+        const uint8_t* p = object.eh_frame_hdr + 4;
+        auto eh_frame = reinterpret_cast<const uint8_t*>(encoded(p, object.eh_frame_hdr[1], object.eh_frame_hdr));
+        std::unordered_map<const uint8_t*, Cie> cies;
+
+        p = eh_frame;
+        while (p + 4 <= object.segment_end) {
+            const uint8_t* record = p;
+            uint64_t length = fixed<uint32_t>(p);
+            if (length == 0) { break; }
+            if (length == 0xffffffff) { length = fixed<uint64_t>(p); }
+            const uint8_t* next = p + length;
+            if (next > object.segment_end) { break; }
+            const uint8_t* id_field = p;
+            uint32_t id = fixed<uint32_t>(p);
+            if (id == 0) {
+                cies[record] = parse_cie(p, next);
+            } else {
+                auto cie = cies.find(id_field - id);
+                if (cie != cies.end()) { parse_fde(p, next, cie->second, object); }
+            }
+            p = next;
+        }
+        // at equal pcs the start of a function wins over the end marker of the previous one
+        std::sort(object.rows.begin(), object.rows.end(), [](const Row& a, const Row& b) {
+            return a.pc != b.pc ? a.pc < b.pc : (a.flags & Row::VALID) < (b.flags & Row::VALID);
+        });
+        object.rows.shrink_to_fit();
+    }
+
+    static Cie parse_cie(const uint8_t* p, const uint8_t* end) {
+        Cie cie;
+        uint8_t version = *p++;
+        const char* augmentation = reinterpret_cast<const char*>(p);
+        p += strlen(augmentation) + 1;
+        if (augmentation[0] == 'e' && augmentation[1] == 'h') { p += sizeof(uint64_t); }
+        cie.code_align = uleb(p);
+        cie.data_align = sleb(p);
+        cie.ra_register = version == 1 ? *p++ : uleb(p);
+        if (augmentation[0] == 'z') {
+            cie.augmented = true;
+            uint64_t size = uleb(p);
+            const uint8_t* data_end = p + size;
+            for (const char* a = augmentation + 1; *a; ++a) {
+                if (*a == 'R') {
+                    cie.fde_encoding = *p++;
+                } else if (*a == 'L') {
+                    p++;
+                } else if (*a == 'P') {
+                    uint8_t encoding = *p++;
+                    encoded(p, encoding & ~DW_EH_PE_indirect, nullptr);
+                }
+            }
+            p = data_end;
+        }
+        cie.instructions = p;
+        cie.end = end;
+        return cie;
+    }
+
+    void parse_fde(const uint8_t* p, const uint8_t* end, const Cie& cie, Object& object) {
+        uint64_t pc_begin = encoded(p, cie.fde_encoding, nullptr);
+        uint64_t pc_range = encoded(p, cie.fde_encoding & 0x0f, nullptr);
+        if (cie.augmented) {
+            uint64_t size = uleb(p);
+            p += size;
+        }
+        State initial;
+        uint64_t loc = pc_begin;
+        execute(cie.instructions, cie.end, cie, initial, initial, loc, nullptr);
+        State state = initial;
+        execute(p, end, cie, state, initial, loc, &object.rows);
+        emit(object.rows, loc, state);
+        object.rows.push_back(Row{pc_begin + pc_range, 0, 0, 0, 0});
+    }
+
+    static void emit(std::vector<Row>& rows, uint64_t loc, const State& state) {
+        Row row{loc, 0, 0, 0, 0};
+        bool representable = !state.unsupported && !state.cfa_expression && state.ra_saved &&
+                             (state.cfa_register == dwarf_sp || state.cfa_register == dwarf_bp) &&
+                             state.cfa_offset == static_cast<int32_t>(state.cfa_offset) &&
+                             state.ra_offset == static_cast<int16_t>(state.ra_offset) &&
+                             state.bp_offset == static_cast<int16_t>(state.bp_offset);
+        if (representable) {
+            row.cfa_offset = static_cast<int32_t>(state.cfa_offset);
+            row.ra_offset = static_cast<int16_t>(state.ra_offset);
+            row.bp_offset = static_cast<int16_t>(state.bp_offset);
+            row.flags = Row::VALID | (state.cfa_register == dwarf_bp ? Row::CFA_FROM_BP : 0) |
+                        (state.bp_saved ? Row::BP_SAVED : 0);
+        }
+        if (!rows.empty() && rows.back().pc == loc) {
+            rows.back() = row;
+        } else {
+            rows.push_back(row);
+        }
+    }
+
+    // runs a CFA program, emitting a row before every advance if `rows` is set
+    static void execute(const uint8_t* p, const uint8_t* end, const Cie& cie, State& state, const State& initial,
+                        uint64_t& loc, std::vector<Row>* rows) {
+        std::vector<State> remembered;
+        auto advance = [&](uint64_t delta) {
+            if (rows) { emit(*rows, loc, state); }
+            loc += delta * cie.code_align;
+        };
+        auto offset = [&](uint64_t reg, int64_t value) {
+            if (reg == cie.ra_register) {
+                state.ra_saved = true;
+                state.ra_offset = value;
+            } else if (reg == dwarf_bp) {
+                state.bp_saved = true;
+                state.bp_offset = value;
+            }
+        };
+        auto restore = [&](uint64_t reg) {
+            if (reg == cie.ra_register) {
+                state.ra_saved = initial.ra_saved;
+                state.ra_offset = initial.ra_offset;
+            } else if (reg == dwarf_bp) {
+                state.bp_saved = initial.bp_saved;
+                state.bp_offset = initial.bp_offset;
+            }
+        };
+        auto unsupported = [&](uint64_t reg) {
+            if (reg == cie.ra_register) { state.unsupported = true; }
+            if (reg == dwarf_bp) { state.bp_saved = false; }
+        };
+        while (p < end) {
+            uint8_t op = *p++;
+            switch (op >> 6) {
+                case 1: advance(op & 0x3f); continue;
+                case 2: offset(op & 0x3f, static_cast<int64_t>(uleb(p)) * cie.data_align); continue;
+                case 3: restore(op & 0x3f); continue;
+                default: break;
+            }
+            switch (op) {
+                case 0x00: break;  // nop
+                case 0x01: {       // set_loc
+                    uint64_t target = encoded(p, cie.fde_encoding, nullptr);
+                    if (rows) { emit(*rows, loc, state); }
+                    loc = target;
+                    break;
+                }
+                case 0x02: advance(fixed<uint8_t>(p)); break;
+                case 0x03: advance(fixed<uint16_t>(p)); break;
+                case 0x04: advance(fixed<uint32_t>(p)); break;
+                case 0x05: {  // offset_extended
+                    uint64_t reg = uleb(p);
+                    offset(reg, static_cast<int64_t>(uleb(p)) * cie.data_align);
+                    break;
+                }
+                case 0x06: restore(uleb(p)); break;      // restore_extended
+                case 0x07:                               // undefined
+                case 0x08: unsupported(uleb(p)); break;  // same_value
+                case 0x09: {                             // register
+                    uint64_t reg = uleb(p);
+                    uleb(p);
+                    unsupported(reg);
+                    break;
+                }
+                case 0x0a: remembered.push_back(state); break;
+                case 0x0b:
+                    if (!remembered.empty()) {
+                        // the whole row including the CFA rule, like libgcc and libunwind
+                        state = remembered.back();
+                        remembered.pop_back();
+                    }
+                    break;
+                case 0x0c:  // def_cfa
+                    state.cfa_register = static_cast<unsigned>(uleb(p));
+                    state.cfa_offset = static_cast<int64_t>(uleb(p));
+                    state.cfa_expression = false;
+                    break;
+                case 0x0d:  // def_cfa_register
+                    state.cfa_register = static_cast<unsigned>(uleb(p));
+                    state.cfa_expression = false;
+                    break;
+                case 0x0e: state.cfa_offset = static_cast<int64_t>(uleb(p)); break;  // def_cfa_offset
+                case 0x0f: {                                                         // def_cfa_expression
+                    uint64_t size = uleb(p);
+                    p += size;
+                    state.cfa_expression = true;
+                    break;
+                }
+                case 0x10:    // expression
+                case 0x16: {  // val_expression
+                    uint64_t reg = uleb(p);
+                    uint64_t size = uleb(p);
+                    p += size;
+                    unsupported(reg);
+                    break;
+                }
+                case 0x11: {  // offset_extended_sf
+                    uint64_t reg = uleb(p);
+                    offset(reg, sleb(p) * cie.data_align);
+                    break;
+                }
+                case 0x12:  // def_cfa_sf
+                    state.cfa_register = static_cast<unsigned>(uleb(p));
+                    state.cfa_offset = sleb(p) * cie.data_align;
+                    state.cfa_expression = false;
+                    break;
+                case 0x13: state.cfa_offset = sleb(p) * cie.data_align; break;  // def_cfa_offset_sf
+                case 0x14:                                                      // val_offset
+                case 0x15: {                                                    // val_offset_sf
+                    uint64_t reg = uleb(p);
+                    if (op == 0x14) {
+                        uleb(p);
+                    } else {
+                        sleb(p);
+                    }
+                    unsupported(reg);
+                    break;
+                }
+                case 0x2e: uleb(p); break;  // GNU_args_size
+                case 0x2f: {                // GNU_negative_offset_extended
+                    uint64_t reg = uleb(p);
+                    offset(reg, -static_cast<int64_t>(uleb(p)) * cie.data_align);
+                    break;
+                }
+                default: return;  // unknown opcode, the rest cannot be decoded
+            }
+        }
+    }
+};
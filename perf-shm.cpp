@@ -0,0 +1,43 @@
+/**
+ * Prints live rates of a process publishing its counters with PerfShmPublisher.
+ *
+ *   g++ -std=c++17 -O2 -o perf-shm perf-shm.cpp -lrt
+ *   ./perf-shm /perfevent-<pid> [interval_ms]
+ * */
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+#include "PerfShm.hpp"
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0] << " <shm-name> [interval_ms]" << std::endl;
+        return 1;
+    }
+    PerfShmReader reader(argv[1]);
+    if (!reader) {
+        std::cerr << "cannot attach to " << argv[1] << std::endl;
+        return 1;
+    }
+    auto interval = std::chrono::milliseconds(argc > 2 ? std::stoi(argv[2]) : 1000);
+
+    std::cout << std::setw(8) << "regions" << std::setw(10) << "busy %" << std::setw(8) << "IPC" << std::setw(8)
+              << "GHz" << std::setw(8) << "CPUs" << std::setw(14) << "LLC-miss/s" << std::setw(14) << "br-miss/s"
+              << std::endl;
+    auto prev = reader.read();
+    while (true) {
+        std::this_thread::sleep_for(interval);
+        auto cur = reader.read();
+        if (cur.timestamp_ns == prev.timestamp_ns) { continue; }
+        auto diff = [&](const char* name) { return cur.value(name) - prev.value(name); };
+        double wall_ns = static_cast<double>(cur.timestamp_ns - prev.timestamp_ns);
+        double busy_ns = static_cast<double>(cur.duration_ns - prev.duration_ns);
+        std::cout << std::fixed << std::setprecision(2) << std::setw(8) << cur.regions << std::setw(10)
+                  << 100 * busy_ns / wall_ns << std::setw(8) << diff("instructions") / diff("cycles") << std::setw(8)
+                  << diff("cycles") / diff("task-clock") << std::setw(8) << diff("task-clock") / busy_ns
+                  << std::setw(14) << std::setprecision(0) << diff("LLC-misses") * 1e9 / wall_ns << std::setw(14)
+                  << diff("branch-misses") * 1e9 / wall_ns << std::endl;
+        prev = cur;
+    }
+}
@@ -0,0 +1,31 @@
+/**
+ * Converts a trace streamed by BackgroundTracker (TrackerOptions::stream_path) into the same CSV
+ * format write_events_csv produces. Works on traces of crashed processes as well.
+ *
+ *   g++ -std=c++17 -O2 -o perf-trace perf-trace.cpp
+ *   ./perf-trace trace.bin > trace.csv
+ * */
+#include <algorithm>
+#include <iostream>
+
+#include "PerfTrace.hpp"
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0] << " <trace-file>" << std::endl;
+        return 1;
+    }
+    std::vector<std::string> names;
+    std::vector<PerfTraceFile::Record> records;
+    if (!PerfTraceFile::read(argv[1], names, records)) {
+        std::cerr << "not a valid trace: " << argv[1] << std::endl;
+        return 1;
+    }
+    std::stable_sort(records.begin(), records.end(),
+                     [](auto& a, auto& b) { return a.time_ns < b.time_ns; });
+    std::cout << "event, time, value" << std::endl;
+    for (auto& record : records) {
+        std::cout << PerfTraceFile::label(record.type, names) << ", "
+                  << record.time_ns / 1000 << ", " << record.value << std::endl;
+    }
+}